@@ -26,9 +26,12 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <stdlib.h>
+#ifndef HAL_HOST
 #include "hardware/adc.h"
 #include "hardware/gpio.h"
+#endif
 
 class ResponsiveAnalogRead {
   public:
@@ -56,7 +59,9 @@ class ResponsiveAnalogRead {
     this->adc         = adc;
     this->sleepEnable = sleepEnable;
 
+#ifndef HAL_HOST
     adc_gpio_init(pin);
+#endif
     setSnapMultiplier(snapMultiplier);
   }
 
@@ -197,12 +202,14 @@ class ResponsiveAnalogRead {
     return (int)smoothValue;
   }
 
+#ifndef HAL_HOST
   void update() {
     adc_select_input(adc);
     rawValue = adc_read();
     this->update(rawValue);
   } // updates the value by performing an analogRead() and
     // calculating a responsive value based off it
+#endif
 
   void update(int rawValueRead) {
     rawValue                  = rawValueRead;
@@ -231,3 +238,209 @@ class ResponsiveAnalogRead {
   int prevResponsiveValue;
   bool responsiveValueHasChanged;
 };
+
+/*
+ * Fixed-point implementation of ResponsiveAnalogRead.
+ *
+ * The RP2040's Cortex-M0+ has no FPU, so every float multiply/divide in
+ * getResponsiveValue() is a soft-float call. This variant does the same
+ * maths in Q16.16 integers: floats are only touched when setting the
+ * multiplier or threshold, never per sample. The snap curve is read from a
+ * small table built by setSnapMultiplier().
+ *
+ * It's a drop-in replacement: same API, and outputs within an LSB or so of
+ * the float version.
+ */
+#define RAR_FIXED_SHIFT      16
+#define RAR_FIXED_ONE        (1 << RAR_FIXED_SHIFT)
+#define RAR_ERROR_EMA_FACTOR 19661 // 0.3 in Q16
+#define RAR_SNAP_TABLE_SIZE  64
+#define RAR_SNAP_FULL_LIMIT  8192 // larger than any possible diff
+
+// a (Q16.16) * b (Q16, 0..1.0), in two 32-bit multiplies: the M0+ has a
+// single-cycle 32x32->32 multiply, but no 64-bit result. Always inline, like
+// the snap curve lookup, so that FilterBank::update() can run from RAM.
+static inline __attribute__((always_inline)) int32_t rarFixedMultiply(int32_t a, uint32_t b) {
+  uint32_t magnitude = a < 0 ? -a : a;
+  uint32_t result    = (magnitude >> RAR_FIXED_SHIFT) * b +
+                    (((magnitude & (RAR_FIXED_ONE - 1)) * b) >> RAR_FIXED_SHIFT);
+  return a < 0 ? -(int32_t)result : (int32_t)result;
+}
+
+// ResponsiveAnalogRead's snapCurve(diff * snapMultiplier), in Q16.
+struct RarSnapCurve {
+  uint16_t table[RAR_SNAP_TABLE_SIZE]; // Q16, all < 1.0
+  uint32_t fullFrom;                   // diff at which snap reaches 1.0
+  uint32_t reciprocal;                 // 1 / snapMultiplier, rounded
+
+  void build(float snapMultiplier) {
+    if (snapMultiplier > 1.0) {
+      snapMultiplier = 1.0;
+    }
+    if (snapMultiplier < 0.0) {
+      snapMultiplier = 0.0;
+    }
+
+    // the curve only depends on diff, and is capped at 1.0 from some diff
+    // onwards: find that point, and tabulate the curve below it, computing
+    // each entry exactly as ResponsiveAnalogRead would.
+    fullFrom = 0;
+    while (fullFrom < RAR_SNAP_FULL_LIMIT) {
+      float x = fullFrom * snapMultiplier;
+      float y = 1.0 / (x + 1.0);
+      y       = (1.0 - y) * 2.0;
+      if (y >= 1.0) {
+        break;
+      }
+      if (fullFrom < RAR_SNAP_TABLE_SIZE) {
+        table[fullFrom] = (uint16_t)(y * RAR_FIXED_ONE + 0.5);
+      }
+      fullFrom++;
+    }
+
+    // between the end of the table and fullFrom (only for multipliers under
+    // 1/64) we fall back to snap = 2 * diff / (diff + 1 / multiplier), which
+    // is one trip through the hardware divider.
+    reciprocal = snapMultiplier > 0 ? (uint32_t)(1.0 / snapMultiplier + 0.5) : RAR_SNAP_FULL_LIMIT;
+  }
+
+  inline __attribute__((always_inline)) int32_t operator()(unsigned int diff) const {
+    if (diff >= fullFrom) {
+      return RAR_FIXED_ONE;
+    }
+    if (diff < RAR_SNAP_TABLE_SIZE) {
+      return table[diff];
+    }
+    return (int32_t)((diff << (RAR_FIXED_SHIFT + 1)) / (diff + reciprocal));
+  }
+};
+
+class ResponsiveAnalogReadFixed {
+  public:
+  ResponsiveAnalogReadFixed() {}; // default constructor must be followed by call to
+                                  // begin function
+  ResponsiveAnalogReadFixed(int adc, bool sleepEnable, float snapMultiplier = 0.01) {
+    begin(adc, sleepEnable, snapMultiplier);
+  };
+
+  void begin(int adc, bool sleepEnable, float snapMultiplier) {
+    this->adc         = adc;
+    this->sleepEnable = sleepEnable;
+
+#ifndef HAL_HOST
+    adc_gpio_init(26 + adc); // RP2040 GPIO pins map to 26-29
+#endif
+    setSnapMultiplier(snapMultiplier);
+  }
+
+  inline int getValue() const {
+    return responsiveValue;
+  }
+  inline int getRawValue() const {
+    return rawValue;
+  }
+  inline bool hasChanged() const {
+    return responsiveValueHasChanged;
+  }
+  inline bool isSleeping() const {
+    return sleeping;
+  }
+  inline void enableSleep() {
+    sleepEnable = true;
+  }
+  inline void disableSleep() {
+    sleepEnable = false;
+  }
+  inline void enableEdgeSnap() {
+    edgeSnapEnable = true;
+  }
+  inline void disableEdgeSnap() {
+    edgeSnapEnable = false;
+  }
+  inline void setActivityThreshold(float newThreshold) {
+    activityThreshold = (int32_t)(newThreshold * RAR_FIXED_ONE);
+  }
+  inline void setAnalogResolution(int resolution) {
+    analogResolution = resolution;
+  }
+
+  void setSnapMultiplier(float newMultiplier) {
+    snap.build(newMultiplier);
+  }
+
+  int getResponsiveValue(int newValue) {
+    int threshold = activityThreshold >> RAR_FIXED_SHIFT;
+
+    // edge snap, as in ResponsiveAnalogRead
+    if (sleepEnable && edgeSnapEnable) {
+      if (newValue < threshold) {
+        newValue = (newValue * 2) - threshold;
+      } else if (newValue > analogResolution - threshold) {
+        newValue = (newValue * 2) - analogResolution + threshold;
+      }
+    }
+
+    int32_t delta     = newValue * RAR_FIXED_ONE - smoothValue; // newValue can be negative after edge snap
+    unsigned int diff = abs(newValue - (smoothValue >> RAR_FIXED_SHIFT));
+
+    errorEMA += rarFixedMultiply(delta - errorEMA, RAR_ERROR_EMA_FACTOR);
+
+    if (sleepEnable) {
+      sleeping = abs(errorEMA) < activityThreshold;
+    }
+
+    if (sleepEnable && sleeping) {
+      return smoothValue >> RAR_FIXED_SHIFT;
+    }
+
+    int32_t snapValue = snap(diff);
+
+    if (sleepEnable) {
+      snapValue = (snapValue >> 1) + (RAR_FIXED_ONE >> 1);
+    }
+
+    smoothValue += rarFixedMultiply(delta, snapValue);
+
+    // ensure output is in bounds
+    if (smoothValue < 0) {
+      smoothValue = 0;
+    } else if (smoothValue > (analogResolution - 1) << RAR_FIXED_SHIFT) {
+      smoothValue = (analogResolution - 1) << RAR_FIXED_SHIFT;
+    }
+
+    return smoothValue >> RAR_FIXED_SHIFT;
+  }
+
+#ifndef HAL_HOST
+  void update() {
+    adc_select_input(adc);
+    rawValue = adc_read();
+    this->update(rawValue);
+  }
+#endif
+
+  void update(int rawValueRead) {
+    rawValue                  = rawValueRead;
+    prevResponsiveValue       = responsiveValue;
+    responsiveValue           = getResponsiveValue(rawValue);
+    responsiveValueHasChanged = responsiveValue != prevResponsiveValue;
+  }
+
+  private:
+  int adc;
+  int analogResolution = 4096;
+  bool sleepEnable;
+  int32_t activityThreshold = 16 << RAR_FIXED_SHIFT;
+  bool edgeSnapEnable       = true;
+
+  RarSnapCurve snap;
+
+  int32_t smoothValue = 0; // Q16.16
+  int32_t errorEMA    = 0; // Q16.16
+  bool sleeping       = false;
+
+  int rawValue;
+  int responsiveValue;
+  int prevResponsiveValue;
+  bool responsiveValueHasChanged;
+};
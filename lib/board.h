@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Board traits: everything that differs between the boards the firmware
+ * runs on, as compile-time constants.
+ *
+ * Each board is a struct of static constexprs, and code that depends on the
+ * board (the scan engine, the HAL, the output buffers) is written against
+ * Board, the one being built for. So a fader count, a mux mask or whether
+ * the ADC is inverted is a constant to the compiler, not a runtime setting:
+ * loops have fixed bounds, and a branch on a trait folds away.
+ *
+ * The board is picked by the build (see SIXTEEN_NEXT_BOARDS in
+ * CMakeLists.txt), which defines one of SIXTEEN_NX, SIXTEEN_RX or
+ * SIXTEEN_NEXT_DEV_BOARD; with none of them, it's the 16nx.
+ */
+
+struct Board16nx {
+  static constexpr uint8_t deviceIndex   = 5; // as reported over sysex
+  static constexpr uint8_t faderCount    = 16;
+  static constexpr uint8_t firstMuxPin   = 18; // mux address pins are consecutive
+  static constexpr uint8_t muxPinCount   = 4;
+  static constexpr uint8_t adcPin        = 26;
+  static constexpr uint8_t adcResolution = 12;
+  static constexpr bool invertAdc        = false; // pots wired in reverse?
+  static constexpr uint8_t ledPin        = 2;
+  static constexpr uint8_t i2cSdaPin     = 10;
+  static constexpr uint8_t i2cSclPin     = 11;
+
+  // the mux input each fader is on: fader 6 is on input 0, fader 4 on
+  // input 1, and so on
+  static constexpr uint8_t muxOrder[faderCount] = {7, 6, 5, 4, 3, 2, 1, 0, 8, 9, 10, 11, 12, 13, 14, 15};
+};
+
+// the 16rx: a 16nx, with its own device ID
+struct Board16rx : Board16nx {
+  static constexpr uint8_t deviceIndex = 4;
+};
+
+// the 16next dev board: a 16nx, with the LED on another pin
+struct BoardDev : Board16nx {
+  static constexpr uint8_t ledPin = 22;
+};
+
+// a board's traits, plus what follows from them
+template <typename BOARD>
+struct BoardTraits : BOARD {
+  static_assert(BOARD::faderCount <= 16, "fader masks, and the config, are 16 wide");
+  static_assert(BOARD::faderCount <= (1 << BOARD::muxPinCount), "not enough mux inputs");
+  static_assert(BOARD::adcResolution <= 14, "scan frames are 14-bit");
+
+  // all the mux address pins, for masked GPIO writes
+  static constexpr uint32_t muxMask = ((1u << BOARD::muxPinCount) - 1) << BOARD::firstMuxPin;
+  // every fader
+  static constexpr uint16_t allFaders = (uint16_t)((1ul << BOARD::faderCount) - 1);
+};
+
+#if defined(SIXTEEN_NEXT_DEV_BOARD)
+using Board = BoardTraits<BoardDev>;
+#elif defined(SIXTEEN_RX)
+using Board = BoardTraits<Board16rx>;
+#else
+using Board = BoardTraits<Board16nx>;
+#endif
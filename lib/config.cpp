@@ -1,7 +1,11 @@
 #include "config.h"
-#include "flash_onboard.h"
+#include "config_store.h"
 #include "main.h"
 
+#include <string.h>
+
+static_assert(CONFIG_IMAGE_LENGTH <= CONFIG_STORE_MAX_LENGTH, "the config image must fit in the store");
+
 // default memorymap
 // | Address | Format |            Description             |
 // |---------|--------|------------------------------------|
@@ -12,7 +16,8 @@
 // | 4,5     | 0-127  | FADERMIN lsb/msb                   |
 // | 6,7     | 0-127  | FADERMAX lsb/msb                   |
 // | 8       | 0/1    | Soft MIDI thru (default 0)         |
-// | 9-15    |        | Currently unused                   |
+// | 9       | 0-16   | Program change channel for scenes  |
+// | 10-15   |        | Currently unused                   |
 // | 16-31   | 1-16   | Channel for each control (USB)     |
 // | 32-47   | 1-16   | Channel for each control (TRS)     |
 // | 48-63   | 0-127  | CC for each control (USB)          |
@@ -43,48 +48,152 @@ void updateConfig(uint8_t *incomingSysex, uint8_t incomingSysexLength, Controlle
     newMemoryMap[i] = incomingSysex[i + 9];
   }
 
-  // 2) store that into memory...
-  saveConfig(newMemoryMap);
-
-  // 3) and now read that memory, loading it as data
+  // 2) apply it to the device straight away...
   applyConfig(newMemoryMap, cConfig);
+
+  // 3) and store it, as the current scene: it's committed to flash once the
+  // edits stop
+  saveConfig(newMemoryMap, cConfig->scene);
+}
+
+// partial edits: patch one section of the current memory map from the
+// sysex payload (which starts at offset 9, as for a full edit), re-apply
+// just that section, and queue the result to be stored. Each section is a
+// list of {memory map address, length} runs, filled from the payload in
+// order.
+struct ConfigRun {
+  uint8_t address;
+  uint8_t length;
+};
+
+static void updateConfigSection(uint8_t *incomingSysex, const ConfigRun *runs, uint8_t runCount,
+                                void (*apply)(uint8_t *, ControllerConfig *), ControllerConfig *cConfig) {
+  uint8_t memoryMap[MEMORY_MAP_LENGTH];
+  loadMemoryMap(cConfig->scene, memoryMap);
+
+  uint8_t *payload = incomingSysex + 9;
+  for (uint8_t r = 0; r < runCount; r++) {
+    memcpy(memoryMap + runs[r].address, payload, runs[r].length);
+    payload += runs[r].length;
+  }
+
+  apply(memoryMap, cConfig);
+  saveConfig(memoryMap, cConfig->scene);
+}
+
+// 0x0D: 16 bytes of device options, addresses 0-15
+void updateDeviceOptions(uint8_t *incomingSysex, ControllerConfig *cConfig) {
+  static const ConfigRun runs[] = {{0, 16}};
+  updateConfigSection(incomingSysex, runs, 1, applyDeviceOptions, cConfig);
+}
+
+// 0x0C: 16 USB channels (16-31) then 16 USB CCs (48-63)
+void updateUsbOptions(uint8_t *incomingSysex, ControllerConfig *cConfig) {
+  static const ConfigRun runs[] = {{16, 16}, {48, 16}};
+  updateConfigSection(incomingSysex, runs, 2, applyUsbOptions, cConfig);
+}
+
+// 0x0B: 16 TRS channels (32-47) then 16 TRS CCs (64-79)
+void updateTrsOptions(uint8_t *incomingSysex, ControllerConfig *cConfig) {
+  static const ConfigRun runs[] = {{32, 16}, {64, 16}};
+  updateConfigSection(incomingSysex, runs, 2, applyTrsOptions, cConfig);
+}
+
+// where each scene's part of the memory map, and its destinations, are
+static uint16_t sceneMapOffset(uint8_t scene) {
+  return scene ? SCENES_START + (scene - 1) * SCENE_LENGTH : SCENE_MAP_START;
+}
+
+static uint16_t sceneDestinationsOffset(uint8_t scene) {
+  return scene ? SCENES_START + (scene - 1) * SCENE_LENGTH + SCENE_MAP_LENGTH
+               : MEMORY_MAP_LENGTH + CALIBRATION_LENGTH;
+}
+
+// length bytes of the stored image from offset, straight from the config
+// store's RAM copy; anything that hasn't been stored reads as erased
+static void readImage(uint16_t offset, uint8_t *buf, uint16_t length) {
+  const uint8_t *image = configStoreImage();
+  uint16_t stored      = image && configStoreLength() > offset ? configStoreLength() - offset : 0;
+  if (stored > length) {
+    stored = length;
+  }
+  if (stored) {
+    memcpy(buf, image + offset, stored);
+  }
+  memset(buf + stored, 0xFF, length - stored);
+}
+
+void loadMemoryMap(uint8_t scene, uint8_t *config) {
+  readImage(0, config, SCENE_MAP_START);
+  readImage(sceneMapOffset(scene), config + SCENE_MAP_START, SCENE_MAP_LENGTH);
+  if (config[1] == 0xFF) {
+    memcpy(config, defaultMemoryMap, SCENE_MAP_START);
+  }
+  if (config[SCENE_MAP_START] == 0xFF) {
+    memcpy(config + SCENE_MAP_START, defaultMemoryMap + SCENE_MAP_START, SCENE_MAP_LENGTH);
+  }
 }
 
 void loadConfig(ControllerConfig *cConfig, bool setDefault) {
-  // read 86 bytes from internal flash
-  uint8_t buf[MEMORY_MAP_LENGTH];
-  readFlash(buf, MEMORY_MAP_LENGTH);
-  // if the 2nd byte is unwritten, that means we should write the default
-  // settings to flash
-  if (setDefault && (buf[1] == 0xFF)) {
+  // if nothing's stored (or the 2nd byte is unwritten), that means we
+  // should write the default settings to flash
+  const uint8_t *image = configStoreImage();
+  if (setDefault && (!image || configStoreLength() < 2 || image[1] == 0xFF)) {
     setDefaultConfig();
-    sleep_us(500);
-    loadConfig(cConfig); // call yourself again, and default to read + apply
-  } else {
-    applyConfig(buf, cConfig);
+  }
+
+  // decode every scene, from the config store's RAM image, and the
+  // calibration they share
+  uint8_t scene = cConfig->scene;
+  for (uint8_t s = 0; s < SCENE_COUNT; s++) {
+    uint8_t memoryMap[MEMORY_MAP_LENGTH];
+    loadMemoryMap(s, memoryMap);
+    cConfig->scene = s;
+    applyConfig(memoryMap, cConfig);
+
+    uint8_t destinations[FADER_DESTINATIONS * DESTINATION_LENGTH];
+    for (uint8_t i = 0; i < 16; i++) {
+      readImage(sceneDestinationsOffset(s) + i * sizeof(destinations), destinations, sizeof(destinations));
+      decodeDestinations(destinations, cConfig->scenes[s].destinations[i]);
+    }
+  }
+  cConfig->scene = scene;
+
+  for (uint8_t i = 0; i < 16; i++) {
+    uint8_t calibration[CALIBRATION_FADER_LENGTH];
+    readImage(MEMORY_MAP_LENGTH + i * CALIBRATION_FADER_LENGTH, calibration, CALIBRATION_FADER_LENGTH);
+    decodeCalibration(calibration, &cConfig->calibration[i]);
   }
 }
+
 void applyConfig(uint8_t *conf, ControllerConfig *cConfig) {
   // take the config in a buffer and apply it to the device
   // this means you could load from RAM or just go straight from sysex.
+  applyDeviceOptions(conf, cConfig);
+  applyUsbOptions(conf, cConfig);
+  applyTrsOptions(conf, cConfig);
+}
 
-  cConfig->powerLed  = conf[0];
-  cConfig->midiLed   = conf[1];
-  cConfig->rotated   = conf[2];
-  cConfig->i2cLeader = conf[3];
-  cConfig->midiThru  = conf[8];
+// each of these only looks at its own section of the memory map
 
+void applyDeviceOptions(uint8_t *conf, ControllerConfig *cConfig) {
+  cConfig->powerLed     = conf[0];
+  cConfig->midiLed      = conf[1];
+  cConfig->rotated      = conf[2];
+  cConfig->i2cLeader    = conf[3];
+  cConfig->faderMin     = conf[4] | (conf[5] << 7);
+  cConfig->faderMax     = conf[6] | (conf[7] << 7);
+  cConfig->midiThru     = conf[8];
+  cConfig->sceneChannel = conf[9] <= 16 ? conf[9] : 0;
+}
+
+void applyUsbOptions(uint8_t *conf, ControllerConfig *cConfig) {
+  SceneConfig *scene = &cConfig->scenes[cConfig->scene];
   for (uint8_t i = 0; i < 16; i++) {
-    cConfig->usbMidiChannels[i] = conf[16 + i];
-  }
-  for (uint8_t i = 0; i < 16; i++) {
-    cConfig->trsMidiChannels[i] = conf[32 + i];
-  }
-  for (uint8_t i = 0; i < 16; i++) {
-    cConfig->usbCCs[i] = conf[48 + i];
+    scene->usbMidiChannels[i] = conf[16 + i];
   }
   for (uint8_t i = 0; i < 16; i++) {
-    cConfig->trsCCs[i] = conf[64 + i];
+    scene->usbCCs[i] = conf[48 + i];
   }
 
   // extract and configure high-resolution data
@@ -92,21 +201,140 @@ void applyConfig(uint8_t *conf, ControllerConfig *cConfig) {
                              ((conf[81] & 0x7F) << 7) |
                              ((conf[82] & 0x03) << 14);
 
+  for (uint8_t i = 0; i < 16; i++) {
+    scene->usbHighResolution[i] = (usbHighResValue & (1 << i)) != 0;
+  }
+}
+
+void applyTrsOptions(uint8_t *conf, ControllerConfig *cConfig) {
+  SceneConfig *scene = &cConfig->scenes[cConfig->scene];
+  for (uint8_t i = 0; i < 16; i++) {
+    scene->trsMidiChannels[i] = conf[32 + i];
+  }
+  for (uint8_t i = 0; i < 16; i++) {
+    scene->trsCCs[i] = conf[64 + i];
+  }
+
   uint16_t trsHighResValue = (conf[83] & 0x7F) |
                              ((conf[84] & 0x7F) << 7) |
                              ((conf[85] & 0x03) << 14);
 
   for (uint8_t i = 0; i < 16; i++) {
-    cConfig->usbHighResolution[i] = (usbHighResValue & (1 << i)) != 0;
-    cConfig->trsHighResolution[i] = (trsHighResValue & (1 << i)) != 0;
+    scene->trsHighResolution[i] = (trsHighResValue & (1 << i)) != 0;
   }
 }
 
-void saveConfig(uint8_t *config) {
-  writeFlash(config, MEMORY_MAP_LENGTH);
+// the memory map is stored as the shared device options, and the scene's
+// own part, wherever that scene is kept
+void saveConfig(uint8_t *config, uint8_t scene) {
+  configStoreUpdate(0, config, SCENE_MAP_START);
+  configStoreUpdate(sceneMapOffset(scene), config + SCENE_MAP_START, SCENE_MAP_LENGTH);
 }
 
+// every scene goes back to the defaults (the others by being erased).
+// Calibration belongs to the faders, so it survives a factory reset, as do
+// the destinations, which are edited on their own.
 void setDefaultConfig() {
-  eraseFlashSector();
-  saveConfig(defaultMemoryMap);
+  saveConfig(defaultMemoryMap, 0);
+  uint8_t erased[SCENE_MAP_LENGTH];
+  memset(erased, 0xFF, SCENE_MAP_LENGTH);
+  for (uint8_t s = 1; s < SCENE_COUNT; s++) {
+    configStoreUpdate(sceneMapOffset(s), erased, SCENE_MAP_LENGTH);
+  }
+}
+
+void encodeCalibration(const FaderCalibration *calibration, uint8_t *buf) {
+  buf[0] = calibration->endpointsSet ? 1 : 0;
+  buf[1] = calibration->min & 0x7F;
+  buf[2] = (calibration->min >> 7) & 0x7F;
+  buf[3] = calibration->max & 0x7F;
+  buf[4] = (calibration->max >> 7) & 0x7F;
+  buf[5] = calibration->curve;
+  for (uint8_t b = 0; b < CURVE_BREAKPOINTS; b++) {
+    buf[6 + 2 * b] = calibration->breakpoints[b] & 0x7F;
+    buf[7 + 2 * b] = (calibration->breakpoints[b] >> 7) & 0x7F;
+  }
+}
+
+void decodeCalibration(const uint8_t *buf, FaderCalibration *calibration) {
+  // an erased (or garbled) flags byte: not calibrated
+  bool valid                = buf[0] < 0x80;
+  calibration->endpointsSet = valid && (buf[0] & 1);
+  calibration->min          = (buf[1] & 0x7F) | ((buf[2] & 0x7F) << 7);
+  calibration->max          = (buf[3] & 0x7F) | ((buf[4] & 0x7F) << 7);
+  calibration->curve        = valid && buf[5] < CURVE_TYPES ? buf[5] : CURVE_LINEAR;
+  for (uint8_t b = 0; b < CURVE_BREAKPOINTS; b++) {
+    uint16_t linear             = b * ((1 << 14) - 1) / (CURVE_BREAKPOINTS - 1);
+    calibration->breakpoints[b] = valid ? (buf[6 + 2 * b] & 0x7F) | ((buf[7 + 2 * b] & 0x7F) << 7) : linear;
+  }
+  if (calibration->max <= calibration->min) {
+    calibration->endpointsSet = false;
+  }
+}
+
+void saveCalibration(ControllerConfig *cConfig) {
+  for (uint8_t i = 0; i < 16; i++) {
+    uint8_t calibration[CALIBRATION_FADER_LENGTH];
+    encodeCalibration(&cConfig->calibration[i], calibration);
+    configStoreUpdate(MEMORY_MAP_LENGTH + i * CALIBRATION_FADER_LENGTH, calibration, CALIBRATION_FADER_LENGTH);
+  }
+}
+
+// 0x0A: the fader, then its calibration bytes, as stored
+void updateCalibration(uint8_t *incomingSysex, ControllerConfig *cConfig) {
+  uint8_t *payload = incomingSysex + 9;
+  if (payload[0] >= 16) {
+    return;
+  }
+  decodeCalibration(payload + 1, &cConfig->calibration[payload[0]]);
+  saveCalibration(cConfig);
+}
+
+void encodeDestinations(const FaderDestination *destinations, uint8_t *buf) {
+  for (uint8_t d = 0; d < FADER_DESTINATIONS; d++) {
+    const FaderDestination &destination = destinations[d];
+    uint8_t *bytes                      = buf + d * DESTINATION_LENGTH;
+    bytes[0]                            = destination.type | (destination.ports << 3);
+    bytes[1]                            = destination.channel;
+    bytes[2]                            = destination.number & 0x7F;
+    bytes[3]                            = (destination.number >> 7) & 0x7F;
+  }
+}
+
+void decodeDestinations(const uint8_t *buf, FaderDestination *destinations) {
+  for (uint8_t d = 0; d < FADER_DESTINATIONS; d++) {
+    FaderDestination &destination = destinations[d];
+    const uint8_t *bytes          = buf + d * DESTINATION_LENGTH;
+    // an erased (or garbled) byte, or no ports: nothing there
+    uint8_t type        = bytes[0] & 0x07;
+    uint8_t ports       = (bytes[0] >> 3) & 0x03;
+    bool valid          = bytes[0] < 0x80 && type < DESTINATION_TYPES && ports;
+    destination.type    = valid ? type : DESTINATION_NONE;
+    destination.ports   = valid ? ports : 0;
+    destination.channel = bytes[1] >= 1 && bytes[1] <= 16 ? bytes[1] : 1;
+    destination.number  = valid ? (bytes[2] & 0x7F) | ((bytes[3] & 0x7F) << 7) : 0;
+    if (destination.type == DESTINATION_CC7 || destination.type == DESTINATION_CC14) {
+      destination.number &= 0x7F;
+    }
+    // a 14-bit CC's LSB goes on CC + 32, which must still be a CC
+    if (destination.type == DESTINATION_CC14 && destination.number > DESTINATION_CC14_MAX) {
+      destination.type   = DESTINATION_NONE;
+      destination.ports  = 0;
+      destination.number = 0;
+    }
+  }
+}
+
+// 0x06: the control, then its destinations' bytes, as stored
+void updateDestinations(uint8_t *incomingSysex, ControllerConfig *cConfig) {
+  uint8_t *payload = incomingSysex + 9;
+  if (payload[0] >= 16) {
+    return;
+  }
+  FaderDestination *destinations = cConfig->scenes[cConfig->scene].destinations[payload[0]];
+  decodeDestinations(payload + 1, destinations);
+
+  uint8_t stored[FADER_DESTINATIONS * DESTINATION_LENGTH];
+  encodeDestinations(destinations, stored);
+  configStoreUpdate(sceneDestinationsOffset(cConfig->scene) + payload[0] * sizeof(stored), stored, sizeof(stored));
 }
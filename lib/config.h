@@ -1,10 +1,93 @@
 #pragma once
 
-#include <pico/stdio.h>
-#include <pico/stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// response curves (see fader_curves.h)
+#define CURVE_LINEAR      0
+#define CURVE_LOG         1 // coarse at the bottom of the travel, fine at the top
+#define CURVE_EXP         2 // fine at the bottom, coarse at the top (audio taper)
+#define CURVE_CUSTOM      3 // straight lines through the breakpoints
+#define CURVE_TYPES       4
+#define CURVE_BREAKPOINTS 9 // at 0, 1/8, 2/8 ... of the travel
+
+/*
+ * A fader's calibration: the 14-bit readings at either end of its travel,
+ * and the response curve to apply between them. Without endpoints of its
+ * own, a fader uses the faderbank's FADERMIN/FADERMAX - raw ADC readings,
+ * scaled up to 14 bits - and failing that the full range.
+ */
+struct FaderCalibration {
+  bool endpointsSet;
+  uint16_t min;
+  uint16_t max;
+  uint8_t curve;
+  uint16_t breakpoints[CURVE_BREAKPOINTS]; // CURVE_CUSTOM's output (14-bit) at each
+};
+
+// Calibration is stored after the memory map, in the same config image: per
+// fader, a flags byte (bit 0: endpoints set), min and max (lsb/msb), the
+// curve, and the breakpoints (lsb/msb) - all 7-bit, so the same bytes go
+// over sysex. Erased (0xFF) bytes read as uncalibrated.
+#define CALIBRATION_FADER_LENGTH (1 + 2 + 2 + 1 + 2 * CURVE_BREAKPOINTS)
+#define CALIBRATION_LENGTH       (16 * CALIBRATION_FADER_LENGTH)
+
+// routing matrix destinations (see route_table.h)
+#define DESTINATION_NONE       0
+#define DESTINATION_CC7        1
+#define DESTINATION_CC14       2 // the CC, and CC + 32 for the LSB
+#define DESTINATION_CC14_MAX   31 // so the LSB's CC is a valid one
+#define DESTINATION_NRPN       3 // 14-bit data entry
+#define DESTINATION_PITCH_BEND 4
+#define DESTINATION_TYPES      5
+#define DESTINATION_USB        1 // port bits
+#define DESTINATION_TRS        2
+#define FADER_DESTINATIONS     4 // per control, on top of its USB and TRS CCs
 
 /*
- * Data structure containing all elements of controller config.
+ * One of a control's extra destinations: what to send it as, to which
+ * ports, on which channel (1-16), and the CC or NRPN parameter number
+ * (unused for pitch bend).
+ */
+struct FaderDestination {
+  uint8_t type;
+  uint8_t ports;
+  uint8_t channel;
+  uint16_t number;
+};
+
+// Destinations are stored after the calibration: per control, per
+// destination, the type and ports (type | ports << 3), the channel, and the
+// number (lsb/msb). 7-bit, like the calibration; erased bytes read as none.
+#define DESTINATION_LENGTH  4
+#define DESTINATIONS_LENGTH (16 * FADER_DESTINATIONS * DESTINATION_LENGTH)
+
+// Scenes: each has its own USB and TRS options (memory map addresses 16-85)
+// and destinations; the device options and calibration are shared. Scene 0
+// is the memory map and the destinations above; the others follow, each its
+// options then its destinations. A scene that has never been stored reads
+// as the defaults, with no destinations.
+#define SCENE_COUNT         4
+#define SCENE_MAP_START     16
+#define SCENE_MAP_LENGTH    (MEMORY_MAP_LENGTH - SCENE_MAP_START)
+#define SCENE_LENGTH        (SCENE_MAP_LENGTH + DESTINATIONS_LENGTH)
+#define SCENES_START        (MEMORY_MAP_LENGTH + CALIBRATION_LENGTH + DESTINATIONS_LENGTH)
+#define CONFIG_IMAGE_LENGTH (SCENES_START + (SCENE_COUNT - 1) * SCENE_LENGTH)
+
+// what a scene sets, by control
+struct SceneConfig {
+  uint8_t usbMidiChannels[16];
+  uint8_t usbCCs[16];
+  uint8_t trsMidiChannels[16];
+  uint8_t trsCCs[16];
+  bool usbHighResolution[16];
+  bool trsHighResolution[16];
+  FaderDestination destinations[16][FADER_DESTINATIONS];
+};
+
+/*
+ * Data structure containing all elements of controller config: every
+ * scene's, decoded, so switching scenes doesn't have to read anything.
  */
 struct ControllerConfig {
   bool powerLed;
@@ -14,18 +97,37 @@ struct ControllerConfig {
   uint32_t faderMin;
   uint32_t faderMax;
   bool midiThru;
-  uint8_t usbMidiChannels[16];
-  uint8_t usbCCs[16];
-  uint8_t trsMidiChannels[16];
-  uint8_t trsCCs[16];
-  bool usbHighResolution[16];
-  bool trsHighResolution[16];
+  uint8_t sceneChannel;             // program changes on this channel (1-16) pick the scene; 0: off
+  FaderCalibration calibration[16]; // by physical fader
+  SceneConfig scenes[SCENE_COUNT];
+  uint8_t scene;                    // the current scene: what's sent, and what edits change
 };
 
 extern uint8_t defaultMemoryMap[];
 
 void updateConfig(uint8_t *incomingSysex, uint8_t incomingSysexLength, ControllerConfig *cConfig);
+// partial edits (sysex 0x0D, 0x0C, 0x0B): one section of the memory map
+void updateDeviceOptions(uint8_t *incomingSysex, ControllerConfig *cConfig);
+void updateUsbOptions(uint8_t *incomingSysex, ControllerConfig *cConfig);
+void updateTrsOptions(uint8_t *incomingSysex, ControllerConfig *cConfig);
 void loadConfig(ControllerConfig *cConfig, bool setDefault = false);
+// these apply a memory map to the current scene
 void applyConfig(uint8_t *config, ControllerConfig *cConfig);
-void saveConfig(uint8_t *config);
+void applyDeviceOptions(uint8_t *config, ControllerConfig *cConfig);
+void applyUsbOptions(uint8_t *config, ControllerConfig *cConfig);
+void applyTrsOptions(uint8_t *config, ControllerConfig *cConfig);
+// a scene's memory map: the shared device options and the scene's own
+void loadMemoryMap(uint8_t scene, uint8_t *config);
+void saveConfig(uint8_t *config, uint8_t scene);
 void setDefaultConfig();
+// calibration: a sysex edit of one fader (0x0A), storing the current
+// calibration, and one fader's bytes
+void updateCalibration(uint8_t *incomingSysex, ControllerConfig *cConfig);
+void saveCalibration(ControllerConfig *cConfig);
+void encodeCalibration(const FaderCalibration *calibration, uint8_t *buf);
+void decodeCalibration(const uint8_t *buf, FaderCalibration *calibration);
+// the routing matrix: a sysex edit of one of the current scene's controls
+// (0x06), and one control's bytes
+void updateDestinations(uint8_t *incomingSysex, ControllerConfig *cConfig);
+void encodeDestinations(const FaderDestination *destinations, uint8_t *buf);
+void decodeDestinations(const uint8_t *buf, FaderDestination *destinations);
@@ -0,0 +1,333 @@
+#include "config_store.h"
+
+#include <string.h>
+
+static_assert(HAL_STORAGE_SECTORS >= 2, "the log needs at least two sectors");
+
+#define PAGES_PER_SECTOR (HAL_FLASH_SECTOR_SIZE / HAL_FLASH_PAGE_SIZE)
+#define HEADER_SIZE      sizeof(ConfigRecordHeader)
+#define MAX_RECORD_SIZE  ((HEADER_SIZE + CONFIG_STORE_MAX_LENGTH + HAL_FLASH_PAGE_SIZE - 1) / HAL_FLASH_PAGE_SIZE * HAL_FLASH_PAGE_SIZE)
+
+// the old format lived in the last sector of flash, which is now the last
+// sector of the log
+#define LEGACY_SECTOR    (HAL_STORAGE_SECTORS - 1)
+
+static_assert(MAX_RECORD_SIZE <= HAL_FLASH_SECTOR_SIZE, "a record must fit in a sector");
+
+static uint8_t image[CONFIG_STORE_MAX_LENGTH]; // the current config image
+static uint16_t imageLength   = 0;
+static bool hasImage          = false;
+static uint32_t headSequence  = 0; // 0: nothing stored
+static uint32_t headOffset    = 0; // where the current record is
+static uint32_t nextOffset    = 0; // where the next record goes
+
+static bool pending           = false; // image is newer than the current record
+static uint32_t commitAt;              // when to commit it (halMicros)
+static int32_t erasedAhead    = -1;    // a sector known to be erased, or -1
+
+static uint8_t recordBuffer[MAX_RECORD_SIZE]; // scratch for reading/writing records
+static ConfigStoreStats stats;
+
+/*
+ * CRC-32 (IEEE), a nibble at a time: a 64-byte table rather than 1K.
+ */
+
+static const uint32_t crcTable[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, uint32_t length) {
+  crc = ~crc;
+  for (uint32_t i = 0; i < length; i++) {
+    crc = crcTable[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+    crc = crcTable[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+  }
+  return ~crc;
+}
+
+static uint32_t recordCrc(const ConfigRecordHeader *header, const uint8_t *payload) {
+  uint32_t crc = crc32(0, (const uint8_t *)&header->sequence, sizeof(header->sequence));
+  crc          = crc32(crc, (const uint8_t *)&header->length, sizeof(header->length));
+  return crc32(crc, payload, header->length);
+}
+
+// bytes of flash a record with this much payload takes up
+static uint32_t recordSize(uint16_t length) {
+  return (HEADER_SIZE + length + HAL_FLASH_PAGE_SIZE - 1) / HAL_FLASH_PAGE_SIZE * HAL_FLASH_PAGE_SIZE;
+}
+
+static uint32_t sectorStart(uint32_t offset) {
+  return offset - offset % HAL_FLASH_SECTOR_SIZE;
+}
+
+static uint32_t nextSector(uint32_t offset) {
+  uint32_t next = sectorStart(offset) + HAL_FLASH_SECTOR_SIZE;
+  return next >= HAL_STORAGE_SIZE ? 0 : next;
+}
+
+// read the record at offset into recordBuffer. Returns false if there isn't
+// a complete, valid one there.
+static bool readRecord(uint32_t offset, ConfigRecordHeader *header) {
+  halFlashRead(offset, (uint8_t *)header, HEADER_SIZE);
+  if (header->magic != CONFIG_STORE_MAGIC || header->length > CONFIG_STORE_MAX_LENGTH) {
+    return false;
+  }
+  if (offset % HAL_FLASH_SECTOR_SIZE + recordSize(header->length) > HAL_FLASH_SECTOR_SIZE) {
+    return false;
+  }
+  halFlashRead(offset + HEADER_SIZE, recordBuffer, header->length);
+  return recordCrc(header, recordBuffer) == header->crc;
+}
+
+static bool isErased(uint32_t offset, uint32_t length) {
+  uint8_t buf[32];
+  while (length) {
+    uint32_t chunk = length < sizeof(buf) ? length : sizeof(buf);
+    halFlashRead(offset, buf, chunk);
+    for (uint32_t i = 0; i < chunk; i++) {
+      if (buf[i] != 0xFF) {
+        return false;
+      }
+    }
+    offset += chunk;
+    length -= chunk;
+  }
+  return true;
+}
+
+// the old format: one sector of 256-byte pages, each holding the whole
+// config image. The newest is the last non-empty page.
+static bool readLegacy(uint16_t length, uint8_t *buf) {
+  uint32_t sector = LEGACY_SECTOR * HAL_FLASH_SECTOR_SIZE;
+  int newest      = -1;
+
+  for (int page = 0; page < PAGES_PER_SECTOR; page++) {
+    uint32_t firstWord;
+    halFlashRead(sector + page * HAL_FLASH_PAGE_SIZE, (uint8_t *)&firstWord, sizeof(firstWord));
+    if (firstWord == 0xFFFFFFFF || firstWord == CONFIG_STORE_MAGIC) {
+      break;
+    }
+    newest = page;
+  }
+
+  if (newest < 0 || length > HAL_FLASH_PAGE_SIZE) {
+    return false;
+  }
+  halFlashRead(sector + newest * HAL_FLASH_PAGE_SIZE, buf, length);
+  return true;
+}
+
+void configStoreInit(uint16_t legacyLength) {
+  imageLength  = 0;
+  hasImage     = false;
+  headSequence = 0;
+  headOffset   = 0;
+  nextOffset   = 0;
+  pending      = false;
+  erasedAhead  = -1;
+
+  // find the newest valid record
+  for (uint32_t offset = 0; offset < HAL_STORAGE_SIZE;) {
+    ConfigRecordHeader header;
+    if (!readRecord(offset, &header)) {
+      // empty, torn or not a record: try the next page
+      offset += HAL_FLASH_PAGE_SIZE;
+      continue;
+    }
+
+    if (headSequence == 0 || (int32_t)(header.sequence - headSequence) > 0) {
+      memcpy(image, recordBuffer, header.length);
+      imageLength  = header.length;
+      hasImage     = true;
+      headSequence = header.sequence;
+      headOffset   = offset;
+      nextOffset   = offset + recordSize(header.length);
+      if (nextOffset >= HAL_STORAGE_SIZE) {
+        nextOffset = 0;
+      }
+    }
+    offset += recordSize(header.length);
+  }
+
+  if (headSequence == 0 && legacyLength && readLegacy(legacyLength, recordBuffer)) {
+    // first boot after an upgrade: carry the old config over into the log
+    uint8_t legacy[HAL_FLASH_PAGE_SIZE];
+    memcpy(legacy, recordBuffer, legacyLength);
+    configStoreSave(legacy, legacyLength);
+  }
+}
+
+bool configStoreLoad(uint8_t *buf, uint16_t length) {
+  if (!hasImage) {
+    return false;
+  }
+  uint16_t stored = imageLength < length ? imageLength : length;
+  memcpy(buf, image, stored);
+  memset(buf + stored, 0xFF, length - stored);
+  return true;
+}
+
+const uint8_t *configStoreImage() {
+  return hasImage ? image : nullptr;
+}
+
+uint16_t configStoreLength() {
+  return imageLength;
+}
+
+uint32_t configStoreSequence() {
+  return headSequence;
+}
+
+ConfigStoreStats configStoreStats() {
+  return stats;
+}
+
+bool configStoreSave(const uint8_t *buf, uint16_t length) {
+  if (length > CONFIG_STORE_MAX_LENGTH) {
+    return false;
+  }
+
+  uint32_t size    = recordSize(length);
+  uint32_t offset  = nextOffset;
+  uint32_t startUs = halMicros();
+
+  // records don't cross sectors, and only go into erased flash. If there's
+  // no room here, move on to the next sector - which can't hold the current
+  // record, so it's safe to erase.
+  if (offset % HAL_FLASH_SECTOR_SIZE + size > HAL_FLASH_SECTOR_SIZE) {
+    offset = nextSector(offset);
+  }
+  if (!isErased(offset, size)) {
+    if (offset != sectorStart(offset)) {
+      offset = nextSector(offset);
+    }
+    // failed saves each move the log on a sector, so enough of them bring it
+    // round to the sector holding the current record: never erase that.
+    // Skip it instead, so the next attempt goes in the sector after.
+    if (headSequence && offset == sectorStart(headOffset)) {
+      nextOffset = nextSector(offset);
+      return false;
+    }
+    if ((int32_t)offset != erasedAhead) {
+      halFlashErase(offset, HAL_FLASH_SECTOR_SIZE);
+    }
+  }
+  if (sectorStart(offset) == (uint32_t)erasedAhead) {
+    erasedAhead = -1; // it's about to be used
+  }
+
+  ConfigRecordHeader header;
+  header.magic    = CONFIG_STORE_MAGIC;
+  header.sequence = headSequence + 1;
+  header.length   = length;
+  header.reserved = 0xFFFF;
+  header.crc      = recordCrc(&header, buf);
+
+  memset(recordBuffer, 0xFF, size);
+  memcpy(recordBuffer, &header, HEADER_SIZE);
+  memcpy(recordBuffer + HEADER_SIZE, buf, length);
+  halFlashProgram(offset, recordBuffer, size);
+
+  stats.commits++;
+  stats.lastUs = halMicros() - startUs;
+  if (stats.lastUs > stats.longestUs) {
+    stats.longestUs = stats.lastUs;
+  }
+
+  // make sure it really landed before we start relying on it
+  if (!readRecord(offset, &header)) {
+    nextOffset = nextSector(offset);
+    return false;
+  }
+
+  if (buf != image) {
+    memcpy(image, buf, length);
+  }
+  imageLength  = length;
+  hasImage     = true;
+  pending      = false;
+  headSequence = header.sequence;
+  headOffset   = offset;
+  nextOffset   = offset + size;
+  if (nextOffset >= HAL_STORAGE_SIZE) {
+    nextOffset = 0;
+  }
+  return true;
+}
+
+// does the current record already hold image?
+static bool imageIsCommitted() {
+  ConfigRecordHeader header;
+  if (headSequence == 0) {
+    return false;
+  }
+  halFlashRead(headOffset, (uint8_t *)&header, HEADER_SIZE);
+  if (header.length != imageLength) {
+    return false;
+  }
+  halFlashRead(headOffset + HEADER_SIZE, recordBuffer, imageLength);
+  return memcmp(recordBuffer, image, imageLength) == 0;
+}
+
+void configStoreQueue(const uint8_t *buf, uint16_t length) {
+  if (length > CONFIG_STORE_MAX_LENGTH) {
+    return;
+  }
+  memcpy(image, buf, length);
+  imageLength = length;
+  hasImage    = true;
+  pending     = true;
+  // every edit pushes the commit back, so a burst becomes one record
+  commitAt    = halMicros() + CONFIG_STORE_COMMIT_DELAY_MS * 1000;
+}
+
+void configStoreUpdate(uint16_t offset, const uint8_t *buf, uint16_t length) {
+  if (offset + length > CONFIG_STORE_MAX_LENGTH) {
+    return;
+  }
+  if (!hasImage) {
+    imageLength = 0;
+  }
+  if (imageLength < offset + length) {
+    memset(image + imageLength, 0xFF, offset + length - imageLength);
+    imageLength = offset + length;
+  }
+  memcpy(image + offset, buf, length);
+  hasImage = true;
+  pending  = true;
+  commitAt = halMicros() + CONFIG_STORE_COMMIT_DELAY_MS * 1000;
+}
+
+bool configStorePending() {
+  return pending;
+}
+
+void configStoreTask() {
+  if (!pending || !halTimeReached(commitAt)) {
+    return;
+  }
+  pending = false;
+  if (imageIsCommitted()) {
+    return; // edited back to how it was
+  }
+  if (!configStoreSave(image, imageLength)) {
+    // try again (in a fresh sector) after another delay
+    pending  = true;
+    commitAt = halMicros() + CONFIG_STORE_COMMIT_DELAY_MS * 1000;
+  }
+}
+
+void configStorePrepare() {
+  // the next record goes at nextOffset if there's room, otherwise at the
+  // start of the next sector: make sure whichever sector that will be (when
+  // it's a fresh one) is erased.
+  uint32_t upcoming = nextOffset == sectorStart(nextOffset) ? nextOffset : nextSector(nextOffset);
+  if ((int32_t)upcoming == erasedAhead || (headSequence && upcoming == sectorStart(headOffset))) {
+    return;
+  }
+  if (!isErased(upcoming, HAL_FLASH_SECTOR_SIZE)) {
+    halFlashErase(upcoming, HAL_FLASH_SECTOR_SIZE);
+  }
+  erasedAhead = upcoming;
+}
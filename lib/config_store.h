@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hal.h"
+
+/*
+ * Config store: the config image, kept in RAM and persisted to flash as a
+ * log of records across all HAL_STORAGE_SECTORS sectors.
+ *
+ * Each record is a ConfigRecordHeader followed by the whole config image,
+ * page-aligned and possibly spanning several pages (but never a sector
+ * boundary). Saving appends a record with the next sequence number; when a
+ * sector fills up, the log moves on to the next one, erasing it first. The
+ * oldest sector is only erased once newer records exist elsewhere, so a
+ * torn write (power lost mid-program) only ever loses the record being
+ * written: its CRC won't match, and the previous record is used instead.
+ * A save that doesn't read back moves the log on to the next sector, but
+ * never into (and so never erases) the one holding the current record.
+ *
+ * configStoreInit() scans the log once at boot, keeps the newest valid
+ * record in RAM and remembers where the next record goes, so loads cost a
+ * memcpy and saves never need to search. A sector holding the old one-page
+ * format (see README) is migrated into the log on first boot.
+ *
+ * Edits don't have to touch flash straight away: configStoreQueue() updates
+ * the RAM image at once, and configStoreTask() (from the main loop) commits
+ * it once no more edits have arrived for CONFIG_STORE_COMMIT_DELAY_MS - so a
+ * burst of edits from the editor becomes one record, and an edit that puts
+ * things back as they were writes nothing at all. Erasing a sector stalls
+ * everything for tens of ms, so configStorePrepare() does it ahead of time,
+ * when the caller knows nobody is playing; a commit is then just page
+ * programs.
+ */
+
+#define CONFIG_STORE_MAGIC      0x31434E36 // "6NC1"
+#define CONFIG_STORE_MAX_LENGTH 2032       // largest config image we can store: two records to a sector
+#define CONFIG_STORE_COMMIT_DELAY_MS 1000  // quiet time before a queued image is committed
+
+struct ConfigRecordHeader {
+  uint32_t magic;
+  uint32_t sequence; // newest record has the highest sequence
+  uint16_t length;   // bytes of payload following the header
+  uint16_t reserved; // 0xFFFF
+  uint32_t crc;      // CRC-32 of sequence, length and payload
+};
+
+// legacyLength: the size of the config image in the old one-page format
+void configStoreInit(uint16_t legacyLength);
+// copy the stored image into buf; false if nothing has been stored. If the
+// stored image is shorter than length, the rest of buf is set to 0xFF.
+bool configStoreLoad(uint8_t *buf, uint16_t length);
+// the stored image, in RAM (or nullptr if there isn't one)
+const uint8_t *configStoreImage();
+uint16_t configStoreLength();
+// append a new record now; false if it couldn't be written
+bool configStoreSave(const uint8_t *buf, uint16_t length);
+// replace the RAM image now, and commit it to flash later
+void configStoreQueue(const uint8_t *buf, uint16_t length);
+// replace length bytes of the RAM image at offset (growing it, with 0xFF,
+// if need be), and commit it to flash later
+void configStoreUpdate(uint16_t offset, const uint8_t *buf, uint16_t length);
+// is there a queued image that hasn't been committed yet?
+bool configStorePending();
+// commit the queued image, if it's due
+void configStoreTask();
+// erase the sector the log will need next, if it isn't already. Stalls for
+// as long as an erase takes, so only call it when that won't be noticed.
+void configStorePrepare();
+// the sequence number of the current record (0 if none)
+uint32_t configStoreSequence();
+// records written since boot, and how long the longest and the last took
+// (erase included, if there was one)
+struct ConfigStoreStats {
+  uint32_t commits;
+  uint32_t longestUs;
+  uint32_t lastUs;
+};
+ConfigStoreStats configStoreStats();
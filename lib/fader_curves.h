@@ -0,0 +1,123 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#include "board.h"
+#include "config.h"
+
+/*
+ * Calibration and response curves, compiled into a lookup table per fader.
+ *
+ * Each table maps a 14-bit filtered reading to a 14-bit output: the reading
+ * is scaled so the fader's calibrated endpoints span the whole range
+ * (clamped beyond them), then bent by its curve. A table holds the output
+ * at every 64th reading - CURVE_LUT_SIZE entries, 514 bytes a fader - and
+ * apply() interpolates between the two entries either side, so a reading
+ * costs a lookup, a multiply and a shift however complicated the curve.
+ *
+ * FADERMIN/FADERMAX, which calibrate every fader without endpoints of its
+ * own, are raw ADC readings, as the 16n's were; they're scaled up to 14
+ * bits (<< CURVE_LEGACY_SHIFT) to use as endpoints.
+ *
+ * Tables are rebuilt from the calibration (which is what's stored) whenever
+ * it, or the config, changes; only the log and exp shapes need floating
+ * point, and those are worked out once, in begin(). An uncalibrated linear
+ * fader's table is exact: its output is its input.
+ *
+ * Tables are built and read on the same core, between outputs, so a fader's
+ * table never changes while it's being read.
+ */
+
+#define CURVE_LUT_BITS     8 // 2^8 segments of 64 readings
+#define CURVE_LUT_SIZE     ((1 << CURVE_LUT_BITS) + 1)
+#define CURVE_FULL_SCALE   (1 << 14)
+#define CURVE_STEEPNESS    4.0f // of the log and exp curves: e^4 to 1 end to end
+#define CURVE_LEGACY_SHIFT (14 - Board::adcResolution) // FADERMIN/FADERMAX to 14 bits
+
+template <uint8_t N>
+class FaderCurves {
+  static const uint8_t SEGMENT_BITS    = 14 - CURVE_LUT_BITS;
+  static const uint8_t BREAKPOINT_BITS = 11; // breakpoints are 2048 apart
+  static_assert((CURVE_BREAKPOINTS - 1) << BREAKPOINT_BITS == CURVE_FULL_SCALE, "breakpoints span the travel");
+
+  public:
+  void begin() {
+    // exp: (e^(kx) - 1) / (e^k - 1); log is its inverse
+    float range = expf(CURVE_STEEPNESS) - 1;
+    for (uint16_t k = 0; k < CURVE_LUT_SIZE; k++) {
+      float x     = (float)k / (CURVE_LUT_SIZE - 1);
+      expShape[k] = lroundf((expf(CURVE_STEEPNESS * x) - 1) / range * CURVE_FULL_SCALE);
+      logShape[k] = lroundf(logf(1 + x * range) / CURVE_STEEPNESS * CURVE_FULL_SCALE);
+    }
+  }
+
+  // rebuild every fader's table
+  void build(const ControllerConfig &config) {
+    for (uint8_t i = 0; i < N; i++) {
+      build(i, config);
+    }
+  }
+
+  void build(uint8_t i, const ControllerConfig &config) {
+    const FaderCalibration &calibration = config.calibration[i];
+
+    // the endpoints: the fader's own, the faderbank's, or the full range
+    uint16_t min = 0;
+    uint16_t max = CURVE_FULL_SCALE - 1;
+    if (calibration.endpointsSet) {
+      min = calibration.min;
+      max = calibration.max;
+    } else if (config.faderMax > config.faderMin && config.faderMax < (1u << Board::adcResolution)) {
+      min = config.faderMin << CURVE_LEGACY_SHIFT;
+      max = config.faderMax << CURVE_LEGACY_SHIFT;
+    }
+
+    uint16_t *lut = luts[i];
+    for (uint16_t k = 0; k < CURVE_LUT_SIZE; k++) {
+      // where this reading is in the calibrated travel, 0 to CURVE_FULL_SCALE
+      int32_t position = ((int32_t)(k << SEGMENT_BITS) - min) * CURVE_FULL_SCALE / (max - min);
+      position         = position < 0 ? 0 : position > CURVE_FULL_SCALE ? CURVE_FULL_SCALE : position;
+      lut[k]           = shape(calibration, position);
+    }
+  }
+
+  // a filtered reading, calibrated and curved
+  uint16_t apply(uint8_t i, uint16_t value) const {
+    const uint16_t *lut = luts[i] + (value >> SEGMENT_BITS);
+    int32_t fraction    = value & ((1 << SEGMENT_BITS) - 1);
+    int32_t out         = lut[0] + (((lut[1] - lut[0]) * fraction) >> SEGMENT_BITS);
+    // full scale is one past the top of the 14-bit range
+    return out - (out >> 14);
+  }
+
+  private:
+  uint16_t shape(const FaderCalibration &calibration, int32_t position) const {
+    switch (calibration.curve) {
+    case CURVE_LOG:
+      return interpolate(logShape, position, SEGMENT_BITS, CURVE_LUT_SIZE);
+    case CURVE_EXP:
+      return interpolate(expShape, position, SEGMENT_BITS, CURVE_LUT_SIZE);
+    case CURVE_CUSTOM:
+      return interpolate(calibration.breakpoints, position, BREAKPOINT_BITS, CURVE_BREAKPOINTS);
+    case CURVE_LINEAR:
+    default:
+      return position;
+    }
+  }
+
+  // the straight line between the points either side of position, where
+  // points are (1 << bits) apart
+  static uint16_t interpolate(const uint16_t *points, int32_t position, uint8_t bits, uint16_t count) {
+    int32_t index = position >> bits;
+    if (index >= count - 1) {
+      return points[count - 1];
+    }
+    int32_t fraction = position & ((1 << bits) - 1);
+    return points[index] + (((points[index + 1] - points[index]) * fraction) >> bits);
+  }
+
+  uint16_t luts[N][CURVE_LUT_SIZE];
+  uint16_t expShape[CURVE_LUT_SIZE];
+  uint16_t logShape[CURVE_LUT_SIZE];
+};
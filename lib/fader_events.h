@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+#include "hal.h"
+
+/*
+ * A change in a fader's filtered value, as published by the sampling side
+ * (core1, when CORE1_SCANNING is enabled) to the output side.
+ */
+struct FaderEvent {
+  uint8_t index;      // physical fader index
+  uint16_t value;     // 14-bit filtered value
+  uint32_t timestamp; // time_us_32() at which the frame was captured
+};
+
+/*
+ * Lock-free single-producer / single-consumer ring of FaderEvents.
+ *
+ * Exactly one core may push and exactly one core may pop. Indices are only
+ * ever loaded and stored (never read-modify-written) across cores, so no
+ * locks or atomic RMW instructions are needed - which matters on the M0+.
+ * SIZE must be a power of two.
+ */
+template <uint16_t SIZE>
+class FaderEventQueue {
+  static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+
+  public:
+  // producer side. Returns false (and drops nothing) if the queue is full.
+  bool HAL_RAM_FUNC(push)(const FaderEvent &event) {
+    uint32_t head = this->head.load(std::memory_order_relaxed);
+    if (head - tail.load(std::memory_order_acquire) >= SIZE) {
+      return false;
+    }
+    events[head & (SIZE - 1)] = event;
+    this->head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer side. Returns false if there's nothing to pop.
+  bool pop(FaderEvent &event) {
+    uint32_t tail = this->tail.load(std::memory_order_relaxed);
+    if (tail == head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    event = events[tail & (SIZE - 1)];
+    this->tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  private:
+  FaderEvent events[SIZE];
+  std::atomic<uint32_t> head{0};
+  std::atomic<uint32_t> tail{0};
+};
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+#include "board.h"
+#include "hal.h"
+
+/*
+ * Background fader scan engine.
+ *
+ * A timer alarm steps the mux through each fader in turn. Once the mux has
+ * settled, the ADC takes OVERSAMPLE conversions back to back (free-running)
+ * while DMA moves them out of the ADC FIFO; the DMA is re-armed for each
+ * dwell, so it stops after exactly OVERSAMPLE samples. When the last fader
+ * has converted, the samples are decimated into the back half of a
+ * double-buffered frame, the buffers are swapped and the frame is published.
+ * The main loop only ever consumes finished frames.
+ *
+ * Not every fader is scanned every frame. The consumer tells the scan which
+ * faders are active (ie, their filters are awake) and those are scanned
+ * every frame; the rest are scanned in the background, every
+ * backgroundDivider frames, staggered so that only a few idle faders share
+ * any one frame. Each published frame carries a mask of the faders that were
+ * sampled in it; the other slots are stale.
+ *
+ * Frames are always SCAN_FRAME_BITS (14) bits wide: the sum of the
+ * oversampled conversions, scaled. Every 4x oversampling adds one genuine bit
+ * of resolution (the ADC's own noise acting as dither), so 16 conversions
+ * per fader are needed for a true 14-bit value. On a board whose pots are
+ * wired in reverse, the frame is inverted here too.
+ *
+ * The fader count, mux order, ADC resolution and inversion all come from
+ * the board's traits (board.h), so they're constants here.
+ *
+ * The sequencing lives in FaderScanSequencer, which only talks to the hardware
+ * through ScanHardware - so it can be driven against a simulated ADC/mux.
+ * Whatever step() touches is in RAM (code and data), so the scan carries on
+ * while core0 writes to flash. That includes how it calls the hardware:
+ * step() takes it by its own type, so the calls to a final ScanHardware go
+ * straight to its methods rather than through a vtable (which, like all
+ * const data, is in flash).
+ */
+
+#define SCAN_FRAME_BITS        14
+#define SCAN_MUX_SETTLE_US     10 // time for the mux output to settle after switching
+#define SCAN_CONVERSION_US     2  // one conversion is 96 ADC clocks at 48MHz
+#define SCAN_CONVERSION_GAP_US 1  // margin at the end of a dwell
+#define SCAN_MIN_GAP_US        5  // never schedule the next step closer than this
+
+class ScanHardware {
+  public:
+  // put a mux address on the mux address pins
+  virtual void selectMux(uint8_t address) = 0;
+  // start count ADC conversions; their results land in samples[0..count-1]
+  virtual void startConversions(uint16_t *samples, uint8_t count) = 0;
+  // stop converting, and discard any results beyond the count asked for
+  virtual void stopConversions() = 0;
+};
+
+template <typename BOARD, uint8_t OVERSAMPLE = 1>
+class FaderScanSequencer {
+  static const uint8_t N = BOARD::faderCount;
+  static_assert(N <= 16, "scan masks are 16 bits wide");
+  static_assert(OVERSAMPLE >= 1 && OVERSAMPLE <= 64 && (OVERSAMPLE & (OVERSAMPLE - 1)) == 0,
+                "OVERSAMPLE must be a power of two, up to 64");
+
+  public:
+  // framePeriodUs is the time from the start of one frame to the start of
+  // the next. Inactive faders are scanned every backgroundDivider frames.
+  void begin(uint32_t framePeriodUs, uint8_t backgroundDivider) {
+    this->framePeriodUs     = framePeriodUs;
+    this->backgroundDivider = backgroundDivider ? backgroundDivider : 1;
+    activeMask              = ALL;
+    phase                   = START;
+    back                    = 0;
+    published               = 1;
+    frameCount              = 0;
+    for (uint8_t i = 0; i < N; i++) {
+      dwellCounts[i] = 0;
+      muxOrder[i]    = BOARD::muxOrder[i];
+    }
+  }
+
+  // advance the scan by one step, on HW (a ScanHardware). Returns how long
+  // (in us) to wait before calling step() again.
+  template <typename HW>
+  uint32_t HAL_RAM_FUNC(step)(HW &hw, uint32_t nowUs) {
+    switch (phase) {
+    case START:
+      frameStartUs = nowUs;
+      scanMask     = activeMask | backgroundMask();
+      index        = 0;
+      // fall through
+
+    case SELECT:
+    default:
+      hw.stopConversions();
+      while (index < N && !(scanMask & (1 << index))) {
+        index++;
+      }
+      if (index == N) {
+        return publish(nowUs);
+      }
+      hw.selectMux(muxOrder[index]);
+      phase = CONVERT;
+      return SCAN_MUX_SETTLE_US;
+
+    case CONVERT:
+      hw.startConversions(samples + index * OVERSAMPLE, OVERSAMPLE);
+      dwellCounts[index] = dwellCounts[index] + 1;
+      index++;
+      phase = SELECT;
+      return OVERSAMPLE * SCAN_CONVERSION_US + SCAN_CONVERSION_GAP_US;
+    }
+  }
+
+  // copy the most recently published frame into dest (and, optionally, the
+  // time at which its scan started and the mask of faders sampled in it).
+  // Returns false if no frame has been published since the last call. Safe
+  // to call while step() runs in an interrupt: if a frame is published
+  // mid-copy, we copy again.
+  bool HAL_RAM_FUNC(takeFrame)(uint16_t *dest, uint32_t *timestampUs = nullptr, uint16_t *sampledMask = nullptr) {
+    uint32_t count;
+    do {
+      count = frameCount;
+      if (count == lastTaken) {
+        return false;
+      }
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      const uint16_t *frame = frames[published];
+      for (uint8_t i = 0; i < N; i++) {
+        dest[i] = frame[i];
+      }
+      if (timestampUs) {
+        *timestampUs = frameTimes[published];
+      }
+      if (sampledMask) {
+        *sampledMask = frameMasks[published];
+      }
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+    } while (count != frameCount);
+
+    lastTaken = count;
+    return true;
+  }
+
+  // faders to scan every frame, from the next frame on
+  HAL_INLINE void setActive(uint16_t mask) {
+    activeMask = mask & ALL;
+  }
+
+  uint32_t framesPublished() const {
+    return frameCount;
+  }
+
+  // how many times fader i has been sampled since begin()
+  uint32_t dwellCount(uint8_t i) const {
+    return dwellCounts[i];
+  }
+
+  private:
+  static const uint16_t ALL = BOARD::allFaders;
+
+  // the inactive faders due this frame: fader i on every frame where
+  // frameCount % backgroundDivider == i % backgroundDivider
+  uint16_t HAL_RAM_FUNC(backgroundMask)() const {
+    uint16_t mask = 0;
+    for (uint8_t i = frameCount % backgroundDivider; i < N; i += backgroundDivider) {
+      mask |= 1 << i;
+    }
+    return mask;
+  }
+
+  // the last conversion has landed: decimate into the back buffer, make it
+  // the published frame and start filling the other one.
+  uint32_t HAL_RAM_FUNC(publish)(uint32_t nowUs) {
+    decimate(frames[back]);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    frameTimes[back] = frameStartUs;
+    frameMasks[back] = scanMask;
+    published        = back;
+    back ^= 1;
+    frameCount = frameCount + 1;
+
+    phase      = START;
+
+    uint32_t elapsed = nowUs - frameStartUs;
+    if (elapsed + SCAN_MIN_GAP_US >= framePeriodUs) {
+      return SCAN_MIN_GAP_US;
+    }
+    return framePeriodUs - elapsed;
+  }
+
+  void HAL_RAM_FUNC(decimate)(uint16_t *frame) {
+    for (uint8_t i = 0; i < N; i++) {
+      if (!(scanMask & (1 << i))) {
+        continue;
+      }
+      const uint16_t *sample = samples + i * OVERSAMPLE;
+      uint32_t sum           = 0;
+      for (uint8_t j = 0; j < OVERSAMPLE; j++) {
+        sum += sample[j];
+      }
+      uint16_t value = (sum << (SCAN_FRAME_BITS - BOARD::adcResolution)) / OVERSAMPLE;
+      frame[i]       = BOARD::invertAdc ? (1 << SCAN_FRAME_BITS) - 1 - value : value;
+    }
+  }
+
+  enum Phase : uint8_t { START,
+                         SELECT,
+                         CONVERT };
+
+  uint32_t framePeriodUs;
+  uint8_t backgroundDivider     = 1;
+  uint32_t frameStartUs         = 0;
+
+  volatile Phase phase          = START;
+  uint8_t index                 = 0;
+  uint16_t scanMask             = ALL; // faders being scanned this frame
+  uint8_t muxOrder[N];                 // BOARD::muxOrder, copied out of flash
+  volatile uint16_t activeMask  = ALL;
+  volatile uint32_t dwellCounts[N];
+
+  uint16_t samples[N * OVERSAMPLE]; // raw conversions, written by DMA
+  uint16_t frames[2][N];
+  uint32_t frameTimes[2];
+  uint16_t frameMasks[2];
+  uint8_t back                  = 0;
+  volatile uint8_t published    = 1;
+  volatile uint32_t frameCount  = 0;
+  uint32_t lastTaken            = 0;
+};
+
+// faderScanInit() must be called on the core that should service the scan
+// interrupts. The other functions may be called from either core.
+void faderScanInit(uint32_t framePeriodUs, uint8_t backgroundDivider);
+bool faderScanTakeFrame(uint16_t *frame, uint32_t *timestampUs = nullptr, uint16_t *sampledMask = nullptr);
+void faderScanSetActive(uint16_t mask);
+uint32_t faderScanDwellCount(uint8_t fader);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The fader values as the I2C follower serves them, published once per scan.
+ *
+ * The main loop set()s values as they change, into a copy of its own, and
+ * publish()es the lot at the end of the scan: it's copied into a buffer no
+ * reader is using, which then becomes the current one with a single store.
+ * A reader (the I2C interrupt) latch()es the current buffer at the start of
+ * a transaction and reads from it for as long as it likes - the writer
+ * never touches a latched buffer, which is why there are three: the
+ * current one, the latched one (which may be the same) and one to write.
+ *
+ * One writer, one reader; as with FaderEventQueue, the indices are only
+ * ever loaded and stored.
+ */
+template <uint8_t N>
+class FaderSnapshot {
+  public:
+  // writer side
+  void set(uint8_t i, uint16_t value) {
+    working[i] = value;
+  }
+
+  uint16_t get(uint8_t i) const {
+    return working[i];
+  }
+
+  void publish() {
+    uint8_t current = this->current.load(std::memory_order_relaxed);
+    uint8_t latched = this->latched.load(std::memory_order_acquire);
+    uint8_t next    = 0;
+    while (next == current || next == latched) {
+      next++;
+    }
+    memcpy(buffers[next], working, sizeof(working));
+    this->current.store(next, std::memory_order_release);
+  }
+
+  // reader side: the values as of the last publish(), which stay put until
+  // the next latch()
+  const uint16_t *latch() {
+    uint8_t current = this->current.load(std::memory_order_acquire);
+    latched.store(current, std::memory_order_release);
+    return buffers[current];
+  }
+
+  private:
+  uint16_t working[N] = {};
+  uint16_t buffers[3][N] = {};
+  std::atomic<uint8_t> current{0};
+  std::atomic<uint8_t> latched{0};
+};
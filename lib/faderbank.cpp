@@ -0,0 +1,790 @@
+#include "faderbank.h"
+
+#include "config.h"
+#include "config_store.h"
+#include "fader_curves.h"
+#include "fader_events.h"
+#include "fader_scan.h"
+#include "fader_snapshot.h"
+#include "filter_bank.h"
+#include "hal.h"
+#include "i2c_utils.h"
+#include "latency.h"
+#include "main.h"
+#include "midi_parser.h"
+#include "route_table.h"
+#include "sysex.h"
+#include "trs_midi.h"
+#include "usb_midi.h"
+
+uint32_t midiActivityLightOffAt;
+bool midiActivity            = false;
+uint32_t lastActivityAt; // last MIDI in (clock included) or fader output
+
+bool shouldSendControlUpdate = false;
+uint32_t sendForcedUpdateAt;
+
+ControllerConfig controller;                 // struct to hold controller config
+RouteTable<FADER_COUNT, SCENE_COUNT> routes; // ...and compiled, for the output path
+FaderCurves<FADER_COUNT> curves;             // calibration and response curve tables
+
+// calibration capture: the lowest and highest each fader has read since
+// it started
+bool capturing = false;
+uint16_t captureMin[FADER_COUNT];
+uint16_t captureMax[FADER_COUNT];
+// faders whose calibration, and controls whose destinations, are still to
+// be sent: one message a millisecond, so fader output isn't stuck behind
+// all of them
+uint16_t calibrationToSend  = 0;
+uint16_t destinationsToSend = 0;
+uint32_t sendDumpAt;
+
+// frames are this many times the scale of a single 12-bit conversion
+#define FRAME_SCALE (1 << (SCAN_FRAME_BITS - ADC_RESOLUTION))
+
+uint16_t scanFrame[FADER_COUNT]; // latest raw frame from the scan engine
+uint16_t scanFrameMask;          // faders sampled in scanFrame
+uint16_t previousValues[FADER_COUNT][ROUTE_MAX_OUTPUTS]; // last sent to each output
+UsbMidiPackets<2 * FADER_COUNT> usbMidiOut; // a frame's worth of USB output (MSB + LSB per fader)
+TrsMidiEncoder<FADER_COUNT * ROUTE_MAX_TRS_OUTPUTS> trsMidiOut; // TRS output queue (fader values and thru), paced to the link
+// an entry for every control the routes can send to TRS, so that no live
+// control's value is ever dropped for want of one (see TrsMidiEncoder::find())
+static_assert(FADER_COUNT * ROUTE_MAX_TRS_OUTPUTS <= 255, "TrsMidiEncoder tracks at most 255 controls");
+FaderSnapshot<FADER_COUNT> i2cValues;       // what the I2C follower serves
+
+FilterBank<FADER_COUNT> filters; // filters to smooth analog read.
+
+#ifdef CORE1_SCANNING
+FaderEventQueue<FADER_EVENT_QUEUE_SIZE> faderEvents; // core1 -> core0
+volatile uint16_t faderValues[FADER_COUNT];          // latest filtered values, written by core1
+volatile bool core1Started = false;                   // core1 has set up the scan
+#endif
+
+// effective scan rate of each fader (Hz), measured over the last second
+uint16_t scanRates[FADER_COUNT];
+uint32_t lastDwellCounts[FADER_COUNT];
+uint32_t updateScanRatesAt;
+uint16_t activeHold[FADER_COUNT]; // frames left at the full scan rate
+
+// runtime counters, for the stats query (0x19). The frame counters are
+// written only by whoever takes the frames (core1, if it's scanning); the
+// per-second figures are worked out at the 1s tick, on core0.
+uint32_t loopCount; // main loop iterations this second
+uint32_t loopsPerSecond;
+volatile uint32_t framesTaken;  // since boot
+volatile uint32_t faderChanges; // since boot
+volatile uint16_t mostChanged;  // in one scan
+volatile uint32_t lastFrameTime;
+volatile uint32_t jitterWindowAt; // start of the current jitter window
+volatile uint32_t windowJitterUs; // largest in the current window
+volatile uint32_t lastSecondJitterUs;
+volatile uint32_t maxJitterUs; // since boot
+uint32_t framesPerSecond;
+uint32_t changesPerSecond;
+uint32_t lastFramesTaken;
+uint32_t lastFaderChanges;
+uint32_t uptimeSeconds;
+uint32_t sysexIgnored; // for us, but unknown, too short or too long
+
+// the I2C follower's current read: one input, or all of them
+uint8_t activeInput       = 0;
+bool readingAllInputs     = false;
+const uint16_t *followerValues; // latched for the read
+uint8_t followerOffset    = 0;  // bytes of it sent so far
+
+void faderbankSetup() {
+  configStoreInit(MEMORY_MAP_LENGTH); // find the current config in flash
+  loadConfig(&controller, true);      // load config from flash; write default config TO flash if byte 1 is 0xFF
+  curves.begin();
+  configChanged();
+
+  // setup internal led
+  halLedInit();
+
+  // setup TRS MIDI
+  halUartMidiInit();
+  trsMidiOut.begin(halMicros());
+
+  // setup analog read filters. Scan frames are 14-bit, so everything
+  // measured in LSBs is scaled up from the (12-bit) tuning: the same snap
+  // curve, and an activity threshold of 16 12-bit LSBs.
+  filters.setAnalogResolution(1 << SCAN_FRAME_BITS);
+  filters.begin(true, .05 / FRAME_SCALE);
+  filters.setActivityThreshold(16 * FRAME_SCALE);
+
+#ifdef CORE1_SCANNING
+  // core1 does all the scanning and filtering from here on
+  halLaunchCore1(core1Main);
+  while (!core1Started) {
+  }
+#else
+  // start scanning faders in the background (ADC, mux pins, DMA)
+  faderScanInit(SCAN_FRAME_PERIOD_US, SCAN_BACKGROUND_DIVIDER);
+#endif
+  updateScanRatesAt = halMicros() + 1000000;
+
+  // set up I2C on jack
+  if (controller.i2cLeader) {
+    halI2cInitLeader(I2C_LEADER_BAUDRATE);
+    i2cLeaderInit(); // devices are found in the background, as they appear
+  } else {
+    halI2cInitFollower(I2C_ADDRESS, I2C_BAUDRATE);
+  }
+
+  // init USB
+  halUsbInit();
+
+  // make sure LED is off.
+  halLedSet(false);
+}
+
+void faderbankLoop() {
+  // do the USB task and midi task - as fast as you can.
+  halUsbTask();
+  midi_read_task();
+
+  if (controller.powerLed) {
+    halLedSet(true);
+  } else {
+    halLedSet(controller.midiLed && midiActivity);
+  }
+
+  if (halTimeReached(midiActivityLightOffAt)) {
+    midiActivity = false;
+  }
+
+  loopCount++;
+  if (halTimeReached(updateScanRatesAt)) {
+    updateScanRatesAt += 1000000;
+    updateScanRates();
+    updateCounters();
+  }
+
+  // commit config edits to flash once they've settled, and erase ahead
+  // for the next commit while nobody is playing
+  configStoreTask();
+  if (!configStorePending() && halMicros() - lastActivityAt >= FLASH_PREPARE_IDLE_MS * 1000) {
+    configStorePrepare();
+  }
+
+  if (shouldSendControlUpdate && halTimeReached(sendForcedUpdateAt)) {
+    // we've received a sysex "give me your config request" recently
+    // so we should send the state of all controls whether they've changed
+    // or not
+    trsMidiOut.invalidate();
+    usbMidiOut.invalidate();
+    LATENCY_ORIGIN(halMicros()); // not a new scan: only our own time counts
+#ifdef CORE1_SCANNING
+    for (int i = 0; i < FADER_COUNT; i++) {
+      sendFaderValue(i, faderValues[i], true);
+    }
+    usbMidiOut.send();
+#else
+    updateControls(scanFrame, scanFrameMask, true);
+#endif
+    i2cValues.publish();
+    shouldSendControlUpdate = false;
+  }
+
+  if ((calibrationToSend || destinationsToSend) && halTimeReached(sendDumpAt)) {
+    sendDumpAt = halMicros() + 1000;
+    if (calibrationToSend) {
+      uint8_t fader      = __builtin_ctz(calibrationToSend);
+      calibrationToSend &= calibrationToSend - 1;
+      sendCalibration(fader, &controller.calibration[fader]);
+    } else {
+      uint8_t control     = __builtin_ctz(destinationsToSend);
+      destinationsToSend &= destinationsToSend - 1;
+      sendDestinations(control, controller.scenes[controller.scene].destinations[control]);
+    }
+  }
+
+#ifdef CORE1_SCANNING
+  // core1 has done the scanning and filtering; just send what changed.
+  FaderEvent event;
+  bool popped = false;
+  while (faderEvents.pop(event)) {
+    LATENCY_ORIGIN(event.timestamp);
+    LATENCY_RECORD(LATENCY_SCAN);
+    sendFaderValue(event.index, event.value);
+    popped = true;
+  }
+  usbMidiOut.send();
+  if (popped) {
+    i2cValues.publish();
+  }
+#else
+  // the scan engine runs in the background; we only have fader work to do
+  // once it has finished a frame
+  uint32_t frameTime;
+  if (faderScanTakeFrame(scanFrame, &frameTime, &scanFrameMask)) {
+    LATENCY_ORIGIN(frameTime);
+    LATENCY_RECORD(LATENCY_SCAN);
+    uint16_t changed = updateControls(scanFrame, scanFrameMask);
+    countFrame(frameTime, changed);
+    if (changed) {
+      i2cValues.publish();
+    }
+
+    // faders that are awake get scanned every frame from now on
+    faderScanSetActive(activeFaders(~filters.sleeping() | changed));
+  }
+#endif
+
+  // TRS goes out as fast as the link allows, every time round (not just
+  // on new frames), so a backlog clears as soon as there's room
+  trsMidiOut.encode(halMicros());
+
+  // drain the TX buffer to the TRS midi out - if you don't include this,
+  // no data will ever get sent to the MIDI out.
+  halUartMidiDrain();
+
+  // and keep the I2C bus busy with whatever values are waiting
+  if (controller.i2cLeader) {
+    i2cLeaderTask();
+  }
+}
+
+// what to do with each message coming in over USB
+class UsbMidiInput : public MidiHandler {
+  public:
+  void midiMessage(const uint8_t *message, uint8_t length) override {
+    blink();
+    // a program change on the scene channel picks the scene
+    if (controller.sceneChannel && length == 2 && message[0] == (0xC0 | (controller.sceneChannel - 1))) {
+      selectScene(message[1]);
+    }
+    // forward it thru to midi TRS if relevant.
+    if (controller.midiThru) {
+      trsMidiOut.writeThru(message, length);
+    }
+  }
+
+  void midiRealtime(uint8_t status) override {
+    // clock doesn't blink the light
+    if (status != 0xF8) {
+      blink();
+    }
+    if (controller.midiThru) {
+      trsMidiOut.writeThru(&status, 1);
+    }
+  }
+
+  void midiSysex(uint8_t *message, uint16_t length) override {
+    blink();
+    if (length >= 6 && message[1] == 0x7D && message[2] == 0x00 && message[3] == 0x00) {
+      // it's a sysex message and it's for us!
+      processSysexBuffer(message, length);
+    } else if (controller.midiThru) {
+      trsMidiOut.writeThru(message, length);
+    }
+  }
+
+  // a sysex too long for the parser to hold: it can't be for us (or not one
+  // we can use), so the rest of it is just passed on
+  void midiSysexPart(const uint8_t *data, uint16_t length, bool last) override {
+    if (data[0] == 0xF0) {
+      blink();
+      partsOurs = length >= 4 && data[1] == 0x7D && data[2] == 0x00 && data[3] == 0x00;
+      if (partsOurs) {
+        sysexIgnored++;
+      }
+    }
+    if (!partsOurs && controller.midiThru) {
+      trsMidiOut.writeThruPart(data, length, last);
+    }
+  }
+
+  private:
+  bool partsOurs = false; // the sysex coming in parts has our header
+
+  void blink() {
+    midiActivity           = true;
+    midiActivityLightOffAt = halMicros() + MIDI_BLINK_DURATION;
+  }
+};
+
+UsbMidiInput usbMidiInput;
+MidiParser<SYSEX_BUFFER_SIZE> usbMidiParser;
+
+void midi_read_task() {
+  uint8_t inputBuffer[MIDI_INPUT_BUFFER];
+  // parse every chunk as it's read: messages can span chunks, and one chunk
+  // can hold several
+  while (halUsbMidiAvailable()) {
+    int32_t readLength = MIDI_INPUT_BUFFER;
+    if (controller.midiThru) {
+      // only read what thru is sure to have room for, leaving the rest to
+      // wait in USB: a byte can come out as up to 3 (a running status data
+      // byte, with its status and a segment header), on top of a sysex part
+      // the parser already holds
+      int32_t room = ((int32_t)trsMidiOut.thruRoom() - SYSEX_BUFFER_SIZE - 4) / 3;
+      if (room <= 0) {
+        break;
+      }
+      if (room < readLength) {
+        readLength = room;
+      }
+    }
+    uint32_t streamLength = halUsbMidiRead(inputBuffer, readLength);
+    lastActivityAt        = halMicros();
+    usbMidiParser.parse(inputBuffer, streamLength, usbMidiInput);
+  }
+}
+
+// message is a whole sysex message for us, 0xF0 to 0xF7. The payload of
+// an edit starts at offset 9, after the header, device ID and firmware version.
+void processSysexBuffer(uint8_t *message, uint16_t length) {
+  switch (message[4]) {
+  case 0x1F:
+    // 0x1F == tell me your 1nFo
+    sendCurrentConfig(controller.scene);
+    shouldSendControlUpdate = true;
+    sendForcedUpdateAt      = halMicros() + 100000;
+    break;
+  case 0x0E:
+    // 0x0E == c0nfig Edit
+    if (length >= 9 + MEMORY_MAP_LENGTH + 1) {
+      updateConfig(message, length, &controller);
+      configChanged();
+    } else {
+      sysexIgnored++;
+    }
+    break;
+  case 0x0D:
+    // 0x0D == c0nfig eDit (device options)
+    if (length >= 9 + 16 + 1) {
+      updateDeviceOptions(message, &controller);
+      configChanged();
+    } else {
+      sysexIgnored++;
+    }
+    break;
+  case 0x0C:
+    // 0x0C == c0nfig edit (usb options)
+    if (length >= 9 + 32 + 1) {
+      updateUsbOptions(message, &controller);
+      configChanged();
+    } else {
+      sysexIgnored++;
+    }
+    break;
+  case 0x0B:
+    // 0x0B == c0nfig edit (trs options)
+    if (length >= 9 + 32 + 1) {
+      updateTrsOptions(message, &controller);
+      configChanged();
+    } else {
+      sysexIgnored++;
+    }
+    break;
+  case 0x1A:
+    // 0x1A == initi1Alize to factory defaults
+    setDefaultConfig();
+    loadConfig(&controller);
+    configChanged();
+    break;
+  case 0x05:
+    // 0x05 == 5cene select
+    if (length >= 9 + 1 + 1) {
+      selectScene(message[9]);
+    } else {
+      sysexIgnored++;
+    }
+    break;
+  case 0x19:
+    // 0x19 == tell me your st4Ts
+    sendCounters();
+    break;
+  case 0x0A:
+    // 0x0A == cAlibration edit (one fader)
+    if (length >= 9 + 1 + CALIBRATION_FADER_LENGTH + 1) {
+      updateCalibration(message, &controller);
+      configChanged();
+    } else {
+      sysexIgnored++;
+    }
+    break;
+  case 0x1C:
+    // 0x1C == Calibration Capture: 1 starts it, 0 stops and keeps it
+    if (length >= 9 + 1 + 1) {
+      if (message[9]) {
+        startCapture();
+      } else {
+        finishCapture();
+      }
+    } else {
+      sysexIgnored++;
+    }
+    break;
+  case 0x18:
+    // 0x18 == tell me your calibr8ion
+    calibrationToSend = Board::allFaders;
+    sendDumpAt        = halMicros();
+    break;
+  case 0x06:
+    // 0x06 == r0ute edit (one control's destinations)
+    if (length >= 9 + 1 + FADER_DESTINATIONS * DESTINATION_LENGTH + 1) {
+      updateDestinations(message, &controller);
+      configChanged();
+    } else {
+      sysexIgnored++;
+    }
+    break;
+  case 0x17:
+    // 0x17 == tell me your rou7es
+    destinationsToSend = Board::allFaders;
+    sendDumpAt         = halMicros();
+    break;
+  default:
+    sysexIgnored++;
+    break;
+  }
+}
+
+// the config has changed: recompile what the output path uses. An edit can
+// move the faders to other TRS channels and CCs, so the values queued for the
+// old ones give way to theirs if need be.
+void configChanged() {
+  trsMidiOut.retire();
+  routes.build(controller);
+  curves.build(controller);
+}
+
+// every scene is compiled already: switching is making its routes current.
+// Nothing is resent; each output carries on from its fader's next change.
+void selectScene(uint8_t scene) {
+  if (scene >= SCENE_COUNT) {
+    return;
+  }
+  controller.scene = scene;
+  trsMidiOut.retire();
+  routes.select(scene);
+}
+
+void startCapture() {
+  for (int i = 0; i < FADER_COUNT; i++) {
+    captureMin[i] = (1 << 14) - 1;
+    captureMax[i] = 0;
+  }
+  capturing = true;
+}
+
+// faders that were moved through at least CALIBRATION_MIN_TRAVEL take what
+// they read as their endpoints; the rest keep theirs
+void finishCapture() {
+  if (!capturing) {
+    return;
+  }
+  capturing = false;
+
+  bool changed = false;
+  for (int i = 0; i < FADER_COUNT; i++) {
+    if (captureMax[i] < captureMin[i] || captureMax[i] - captureMin[i] < CALIBRATION_MIN_TRAVEL) {
+      continue;
+    }
+    FaderCalibration &calibration = controller.calibration[i];
+    calibration.endpointsSet      = true;
+    calibration.min               = captureMin[i];
+    calibration.max               = captureMax[i];
+    curves.build(i, controller);
+    changed = true;
+  }
+  if (changed) {
+    saveCalibration(&controller);
+  }
+}
+
+// the stats query's reply: the counters, in the order SYSEX_SPEC.md lists
+void sendCounters() {
+  ConfigStoreStats flash = configStoreStats();
+  I2cLeaderStats i2c     = i2cLeaderStats();
+
+  uint32_t counters[] = {
+      uptimeSeconds,
+      loopsPerSecond,
+      framesPerSecond,
+      lastSecondJitterUs,
+      maxJitterUs,
+      changesPerSecond,
+      mostChanged,
+      usbMidiOut.shortSends() + sysexShortWrites(),
+      usbMidiOut.dropped(),
+      trsMidiOut.modelledHighWater(),
+      trsMidiOut.uartDropped(),
+      trsMidiOut.dropped(),
+      i2c.naks,
+      i2c.timeouts,
+      flash.commits,
+      flash.longestUs,
+      flash.lastUs,
+      usbMidiParser.dropped(),
+      sysexIgnored,
+  };
+  // 0x09 == st4Ts
+  sendCountersAsSysex(0x09, counters, sizeof(counters) / sizeof(counters[0]));
+}
+
+uint16_t updateControls(const uint16_t *frame, uint16_t sampledMask, bool force) {
+  uint16_t changed = filters.update(frame, sampledMask);
+
+  if (force) {
+    // "force" only happens when connecting via sysex initially
+    // ie, it's for the 'first load' of the editor: send everything from the
+    // most recent frame, whether it has changed or not - and we _really_
+    // would like a read, please.
+    filters.update(frame, sampledMask);
+    changed = Board::allFaders;
+  }
+
+  // only visit the faders that changed
+  for (uint16_t bits = changed; bits; bits &= bits - 1) {
+    int i = __builtin_ctz(bits);
+    sendFaderValue(i, filters.getValue(i), force);
+  }
+  // everything that changed this frame goes to USB in one go
+  usbMidiOut.send();
+  return changed;
+}
+
+// which faders to scan every frame. A fader that is awake (or just changed)
+// stays in the set for SCAN_ACTIVE_HOLD_MS: at the full frame rate the
+// per-frame movement of a slow fader is small, so its filter can doze off
+// between changes even though it is still being moved.
+uint16_t HAL_RAM_FUNC(activeFaders)(uint16_t awake) {
+  uint16_t active = 0;
+  for (int i = 0; i < FADER_COUNT; i++) {
+    if (awake & (1 << i)) {
+      activeHold[i] = SCAN_ACTIVE_HOLD_MS * 1000 / SCAN_FRAME_PERIOD_US;
+    } else if (activeHold[i]) {
+      activeHold[i]--;
+    }
+    if (activeHold[i]) {
+      active |= 1 << i;
+    }
+  }
+  return active;
+}
+
+#ifdef CORE1_SCANNING
+// core1 owns the scan engine and the filters. It runs them at the scan
+// rate, regardless of what core0 is up to (USB, sysex, flash), and publishes
+// changes to core0 through faderEvents. Setting up the scan calls into the
+// SDK from flash, so core0 waits for that before going on; from then on
+// core1 runs from RAM, as does all it calls, so flash writes on core0 don't
+// stall it.
+void core1Main() {
+  faderScanInit(SCAN_FRAME_PERIOD_US, SCAN_BACKGROUND_DIVIDER);
+  core1Started = true;
+  core1Loop();
+}
+
+void HAL_RAM_FUNC(core1Loop)() {
+  uint16_t frame[FADER_COUNT];
+  uint32_t frameTime;
+  uint16_t sampledMask;
+  uint16_t pendingMask = 0; // changes that didn't fit in the queue yet
+
+  while (true) {
+    if (!faderScanTakeFrame(frame, &frameTime, &sampledMask)) {
+      continue;
+    }
+
+    uint16_t changed = filters.update(frame, sampledMask);
+    countFrame(frameTime, changed);
+    faderScanSetActive(activeFaders(~filters.sleeping() | changed));
+    for (uint16_t bits = changed; bits; bits &= bits - 1) {
+      int i          = __builtin_ctz(bits);
+      faderValues[i] = filters.getValue(i);
+    }
+    pendingMask |= changed;
+
+    // if core0 has fallen behind, whatever doesn't fit is retried next
+    // frame - with the latest value, rather than queueing stale ones.
+    for (int i = 0; i < FADER_COUNT && pendingMask; i++) {
+      if ((pendingMask & (1 << i)) && faderEvents.push({(uint8_t)i, faderValues[i], frameTime})) {
+        pendingMask &= ~(1 << i);
+      }
+    }
+  }
+}
+#endif
+
+void updateScanRates() {
+  for (int i = 0; i < FADER_COUNT; i++) {
+    uint32_t count     = faderScanDwellCount(i);
+    scanRates[i]       = count - lastDwellCounts[i];
+    lastDwellCounts[i] = count;
+  }
+}
+
+// a frame has been taken: how late (or early) it was, and how much changed.
+// Jitter is how far the time from the last frame's start strays from
+// SCAN_FRAME_PERIOD_US, so a dropped frame shows up too. The window rolls
+// here, rather than at the 1s tick, so only one core ever writes it.
+void HAL_RAM_FUNC(countFrame)(uint32_t frameTime, uint16_t changed) {
+  if (framesTaken) {
+    int32_t interval = frameTime - lastFrameTime;
+    uint32_t jitter  = interval > SCAN_FRAME_PERIOD_US ? interval - SCAN_FRAME_PERIOD_US
+                                                       : SCAN_FRAME_PERIOD_US - interval;
+    if (jitter > windowJitterUs) {
+      windowJitterUs = jitter;
+    }
+    if (jitter > maxJitterUs) {
+      maxJitterUs = jitter;
+    }
+  }
+  if (frameTime - jitterWindowAt >= 1000000) {
+    lastSecondJitterUs = windowJitterUs;
+    windowJitterUs     = 0;
+    jitterWindowAt     = frameTime;
+  }
+  lastFrameTime = frameTime;
+  framesTaken   = framesTaken + 1;
+
+  uint16_t count = __builtin_popcount(changed);
+  faderChanges   = faderChanges + count;
+  if (count > mostChanged) {
+    mostChanged = count;
+  }
+}
+
+// once a second: the per-second counters
+void updateCounters() {
+  uptimeSeconds++;
+  loopsPerSecond   = loopCount;
+  loopCount        = 0;
+
+  uint32_t frames  = framesTaken;
+  uint32_t changes = faderChanges;
+  framesPerSecond  = frames - lastFramesTaken;
+  changesPerSecond = changes - lastFaderChanges;
+  lastFramesTaken  = frames;
+  lastFaderChanges = changes;
+}
+
+// one output's message(s)
+static void sendUsb(const RouteOutput &output, uint16_t value) {
+  switch (output.type) {
+  case DESTINATION_CC7:
+    usbMidiOut.addChannelMessage(output.status, output.number, value);
+    break;
+  case DESTINATION_CC14:
+    usbMidiOut.addChannelMessage(output.status, output.number, value >> 7);
+    usbMidiOut.addChannelMessage(output.status, output.number + 32, value & 0x7F);
+    break;
+  case DESTINATION_NRPN:
+    usbMidiOut.addNrpn(output.status, output.number, value);
+    break;
+  case DESTINATION_PITCH_BEND:
+    usbMidiOut.addPitchBend(output.status, value);
+    break;
+  }
+}
+
+static void sendTrs(const RouteOutput &output, uint16_t value) {
+  switch (output.type) {
+  case DESTINATION_CC7:
+  case DESTINATION_CC14:
+    trsMidiOut.setControlChange(output.status, output.number, value, output.type == DESTINATION_CC14);
+    break;
+  case DESTINATION_NRPN:
+    trsMidiOut.setNrpn(output.status, output.number, value);
+    break;
+  case DESTINATION_PITCH_BEND:
+    trsMidiOut.setPitchBend(output.status, value);
+    break;
+  }
+}
+
+void sendFaderValue(uint8_t i, uint16_t value, bool force) {
+  const FaderRoute &route = routes.current()[i];
+  LATENCY_RECORD(LATENCY_FILTER);
+
+  if (capturing) {
+    captureMin[i] = value < captureMin[i] ? value : captureMin[i];
+    captureMax[i] = value > captureMax[i] ? value : captureMax[i];
+  }
+  value = curves.apply(i, value);
+
+  // store the current value of the fader in this block
+  // for i2c purposes
+  // i2c resolution is 14-bit on 16n; scan frames are oversampled up to
+  // 14 bits, so no scaling is needed.
+  i2cValues.set(i, value ^ route.i2cInvert);
+
+  // every output whose value (at its resolution) has changed
+  bool sent = false;
+  for (uint8_t o = 0; o < route.outputCount; o++) {
+    const RouteOutput &output = route.outputs[o];
+    uint16_t outputValue      = value >> output.shift;
+    if (outputValue == previousValues[i][o] && !force) {
+      continue;
+    }
+    previousValues[i][o] = outputValue;
+    outputValue         ^= output.invert;
+    sent                 = true;
+
+    if (output.port == ROUTE_USB) {
+      sendUsb(output, outputValue);
+    } else {
+      // queued for TRS; it goes out when the link has room for it,
+      // replacing any older value still waiting
+      sendTrs(output, outputValue);
+    }
+  }
+
+  if (sent) {
+    midiActivity           = true;
+    midiActivityLightOffAt = halMicros() + MIDI_BLINK_DURATION;
+    lastActivityAt         = halMicros();
+  }
+
+  if (controller.i2cLeader) {
+    sendToAllI2C(i, i2cValues.get(i));
+  }
+}
+
+// Called from the I2C ISR, so it must complete quickly. Blocking calls /
+// printing to stdio may interfere with interrupt handling.
+//
+// The leader writes the input it wants (0-15), then reads its value back:
+// two bytes, MSB first. Writing I2C_READ_ALL instead reads all 16 inputs,
+// in order, in one 32-byte read. Either way, the values all come from the
+// same scan.
+void i2cFollowerReceive(uint8_t byte) {
+  // parse the response
+  readingAllInputs = byte == I2C_READ_ALL;
+  if (!readingAllInputs) {
+    activeInput = byte > FADER_COUNT - 1 ? FADER_COUNT - 1 : byte;
+  }
+  followerOffset = 0;
+}
+
+uint8_t i2cFollowerRequest(uint8_t *buf, uint8_t maxLength) {
+  if (followerOffset == 0) {
+    followerValues = i2cValues.latch();
+  }
+
+  const uint16_t *values = readingAllInputs ? followerValues : &followerValues[activeInput];
+  uint8_t length         = readingAllInputs ? 2 * FADER_COUNT : 2;
+  uint8_t count          = 0;
+
+  // the value(s) as MSB/LSB
+  while (count < maxLength && followerOffset < length) {
+    uint16_t value = values[followerOffset / 2];
+    buf[count++]   = followerOffset & 1 ? value & 0xFF : value >> 8;
+    followerOffset++;
+  }
+  // reading past the end gets zeros, rather than a hung bus
+  if (count == 0 && maxLength) {
+    buf[count++] = 0;
+  }
+  return count;
+}
+
+void i2cFollowerFinish() {
+  // the next read starts from the top, with fresh values
+  followerOffset = 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "config.h"
+
+/*
+ * The faderbank itself: scanning, filtering, config, sysex and output logic.
+ *
+ * Everything in here talks to the hardware through hal.h, so the same code
+ * runs in the firmware (main.cpp) and in the host simulator (sim/).
+ */
+
+extern ControllerConfig controller;
+extern uint16_t scanRates[]; // effective scan rate of each fader (Hz), over the last second
+
+void faderbankSetup();
+void faderbankLoop(); // one iteration of the main loop
+
+void midi_read_task();
+void processSysexBuffer(uint8_t *message, uint16_t length);
+uint16_t updateControls(const uint16_t *frame, uint16_t sampledMask, bool force = false);
+uint16_t activeFaders(uint16_t awake);
+void updateScanRates();
+void countFrame(uint32_t frameTime, uint16_t changed);
+void updateCounters();
+void sendCounters();
+void configChanged();
+void selectScene(uint8_t scene);
+void startCapture();
+void finishCapture();
+void sendFaderValue(uint8_t i, uint16_t value, bool force = false);
+void core1Main();
+void core1Loop();
+
+// called from the I2C follower interrupt handler, so must be quick: a byte
+// written to us, the next (up to maxLength) bytes of a read, and the end of
+// a transfer
+void i2cFollowerReceive(uint8_t byte);
+uint8_t i2cFollowerRequest(uint8_t *buf, uint8_t maxLength);
+void i2cFollowerFinish();
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ResponsiveAnalogRead.hpp"
+#include "hal.h"
+
+/*
+ * A bank of N ResponsiveAnalogReadFixed filters, stored struct-of-arrays.
+ *
+ * The per-channel state (smooth values, error EMAs, responsive values) lives
+ * in contiguous arrays and the sleeping/changed flags in bitmasks, while the
+ * settings every fader shares (snap curve, activity threshold, resolution)
+ * are stored once. update() filters a whole frame of raw samples in one pass
+ * and returns a mask of the channels whose output changed, so callers only
+ * need to visit the set bits.
+ *
+ * The maths is exactly that of ResponsiveAnalogReadFixed.
+ */
+template <uint8_t N>
+class FilterBank {
+  static_assert(N <= 16, "changed masks are 16 bits wide");
+
+  public:
+  void begin(bool sleepEnable, float snapMultiplier) {
+    this->sleepEnable = sleepEnable;
+    snap.build(snapMultiplier);
+
+    for (uint8_t i = 0; i < N; i++) {
+      smoothValue[i]     = 0;
+      errorEMA[i]        = 0;
+      responsiveValue[i] = 0;
+    }
+    sleepingMask = 0;
+    changedMask  = 0;
+  }
+
+  inline void setSnapMultiplier(float newMultiplier) {
+    snap.build(newMultiplier);
+  }
+  inline void setActivityThreshold(float newThreshold) {
+    activityThreshold = (int32_t)(newThreshold * RAR_FIXED_ONE);
+  }
+  inline void setAnalogResolution(int resolution) {
+    analogResolution = resolution;
+  }
+  inline void enableEdgeSnap() {
+    edgeSnapEnable = true;
+  }
+  inline void disableEdgeSnap() {
+    edgeSnapEnable = false;
+  }
+
+  HAL_INLINE uint16_t getValue(uint8_t i) const {
+    return responsiveValue[i];
+  }
+  inline bool isSleeping(uint8_t i) const {
+    return sleepingMask & (1 << i);
+  }
+  HAL_INLINE uint16_t sleeping() const {
+    return sleepingMask;
+  } // bit i set if channel i is asleep
+  inline uint16_t changed() const {
+    return changedMask;
+  } // bit i set if channel i changed on the last update
+
+  // filter one raw sample per channel, for the channels in mask (the others
+  // keep their state); returns the changed mask.
+  uint16_t HAL_RAM_FUNC(update)(const uint16_t *frame, uint16_t mask = ALL) {
+    int threshold  = activityThreshold >> RAR_FIXED_SHIFT;
+    int32_t maxQ16 = (analogResolution - 1) << RAR_FIXED_SHIFT;
+    bool edgeSnap  = sleepEnable && edgeSnapEnable;
+
+    uint16_t nowSleeping = 0;
+    uint16_t nowChanged  = 0;
+
+    for (uint8_t i = 0; i < N; i++) {
+      if (!(mask & (1 << i))) {
+        continue;
+      }
+
+      int newValue = frame[i];
+      int32_t smooth = smoothValue[i];
+
+      if (edgeSnap) {
+        if (newValue < threshold) {
+          newValue = (newValue * 2) - threshold;
+        } else if (newValue > analogResolution - threshold) {
+          newValue = (newValue * 2) - analogResolution + threshold;
+        }
+      }
+
+      int32_t delta     = newValue * RAR_FIXED_ONE - smooth; // newValue can be negative after edge snap
+      unsigned int diff = abs(newValue - (smooth >> RAR_FIXED_SHIFT));
+
+      int32_t error     = errorEMA[i];
+      error += rarFixedMultiply(delta - error, RAR_ERROR_EMA_FACTOR);
+      errorEMA[i] = error;
+
+      if (sleepEnable && abs(error) < activityThreshold) {
+        nowSleeping |= 1 << i;
+      } else {
+        int32_t snapValue = snap(diff);
+        if (sleepEnable) {
+          snapValue = (snapValue >> 1) + (RAR_FIXED_ONE >> 1);
+        }
+
+        smooth += rarFixedMultiply(delta, snapValue);
+        if (smooth < 0) {
+          smooth = 0;
+        } else if (smooth > maxQ16) {
+          smooth = maxQ16;
+        }
+        smoothValue[i] = smooth;
+      }
+
+      uint16_t value = smooth >> RAR_FIXED_SHIFT;
+      if (value != responsiveValue[i]) {
+        responsiveValue[i] = value;
+        nowChanged |= 1 << i;
+      }
+    }
+
+    sleepingMask = (sleepingMask & ~mask) | nowSleeping;
+    changedMask  = nowChanged;
+    return nowChanged;
+  }
+
+  private:
+  static const uint16_t ALL = (uint16_t)((1ul << N) - 1);
+
+  int32_t smoothValue[N];      // Q16.16
+  int32_t errorEMA[N];         // Q16.16
+  uint16_t responsiveValue[N]; // filter output
+  uint16_t sleepingMask = 0;
+  uint16_t changedMask  = 0;
+
+  RarSnapCurve snap;
+  int32_t activityThreshold = 16 << RAR_FIXED_SHIFT;
+  int analogResolution      = 4096;
+  bool sleepEnable          = true;
+  bool edgeSnapEnable       = true;
+};
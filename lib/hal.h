@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hardware abstraction layer.
+ *
+ * Everything the faderbank core (lib/) needs from the outside world goes
+ * through these functions, so the core never calls pico-sdk or TinyUSB
+ * directly.
+ *
+ * - lib/hal_rp2040.cpp implements them on the RP2040, with the pico-sdk,
+ *   TinyUSB and midi_uart_lib.
+ * - sim/hal_host.cpp implements them on a Linux host, against scripted fader
+ *   traces, a RAM flash image and captured MIDI byte streams.
+ *
+ * The fader scan (ADC + mux) is also platform code: each HAL provides
+ * faderScanInit() / faderScanTakeFrame() from fader_scan.h, driving
+ * FaderScanSequencer with its own ScanHardware.
+ */
+
+// HAL_RAM_FUNC(name) places a function in RAM rather than flash. Everything
+// core1 runs when CORE1_SCANNING is on (the scan interrupt and core1's loop)
+// is marked with it, so core1 keeps going while core0 writes to flash -
+// during which nothing can execute from flash.
+//
+// HAL_INLINE forces the small helpers they call inline: left to the
+// compiler, a helper could be an out-of-line copy in flash (eg, in a debug
+// build). tools/check_core1_ram.py checks the firmware for anything core1
+// can reach in flash.
+#ifdef HAL_HOST
+#define HAL_RAM_FUNC(name) name
+#define HAL_INLINE         inline
+#else
+#include "pico/platform.h"
+#define HAL_RAM_FUNC(name) __not_in_flash_func(name)
+#define HAL_INLINE         __force_inline
+#endif
+
+// time
+uint32_t halMicros();
+void halSleepUs(uint32_t us);
+
+// has halMicros() reached deadlineUs yet? (safe across wraparound)
+static inline bool halTimeReached(uint32_t deadlineUs) {
+  return (int32_t)(halMicros() - deadlineUs) >= 0;
+}
+
+// the internal LED
+void halLedInit();
+void halLedSet(bool on);
+
+// flash storage: HAL_STORAGE_SIZE bytes at the end of flash, addressed from 0.
+// Erase works in whole sectors, program in whole pages; both stall the
+// system while they run (an erase for tens of ms, a page for about 1ms).
+#define HAL_FLASH_PAGE_SIZE   256
+#define HAL_FLASH_SECTOR_SIZE 4096
+#define HAL_STORAGE_SECTORS   4
+#define HAL_STORAGE_SIZE      (HAL_STORAGE_SECTORS * HAL_FLASH_SECTOR_SIZE)
+
+void halFlashRead(uint32_t offset, uint8_t *buf, uint32_t length);
+void halFlashErase(uint32_t offset, uint32_t length);
+void halFlashProgram(uint32_t offset, const uint8_t *buf, uint32_t length);
+
+// I2C on the jack. As a follower, the HAL calls i2cFollowerReceive() and
+// i2cFollowerRequest() (implemented by the core) from its interrupt handler.
+void halI2cInitLeader(uint32_t baudrate);
+void halI2cInitFollower(uint8_t address, uint32_t baudrate);
+// Leader writes, which don't wait for the bus: start one (up to
+// HAL_I2C_MAX_WRITE bytes; false if one is already in flight), then poll
+// until it's done. Poll returns HAL_I2C_BUSY until then, and after that the
+// bytes written, or < 0 if it was NAKed. Abort gives up on the write in
+// flight straight away, and leaves the bus ready for the next one.
+#define HAL_I2C_BUSY      (-100)
+#define HAL_I2C_MAX_WRITE 16
+bool halI2cWriteStart(uint8_t address, const uint8_t *data, size_t length);
+int halI2cWritePoll();
+void halI2cWriteAbort();
+
+// USB MIDI (cable 0)
+void halUsbInit();
+void halUsbTask();
+bool halUsbMidiAvailable();
+uint32_t halUsbMidiRead(uint8_t *buf, uint32_t maxLength);
+uint32_t halUsbMidiWrite(const uint8_t *buf, uint32_t length);
+// write count ready-made 4-byte USB-MIDI event packets (see usb_midi.h);
+// returns how many were accepted
+uint32_t halUsbMidiWritePackets(const uint8_t *packets, uint32_t count);
+
+// TRS MIDI over the UART. Writes are buffered until halUartMidiDrain().
+void halUartMidiInit();
+uint32_t halUartMidiWrite(const uint8_t *buf, uint32_t length);
+void halUartMidiDrain();
+
+// run entry() on core1
+void halLaunchCore1(void (*entry)());
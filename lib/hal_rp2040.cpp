@@ -0,0 +1,439 @@
+/*
+ * RP2040 implementation of hal.h, on top of the pico-sdk, TinyUSB and
+ * midi_uart_lib.
+ */
+
+#include "hal.h"
+
+#include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/gpio.h"
+#include "hardware/i2c.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "pico/i2c_slave.h"
+#include "pico/multicore.h"
+#include "pico/stdlib.h"
+
+#include "device/usbd_pvt.h"
+#include "midi_uart_lib.h"
+#include "tusb.h"
+
+#include "fader_scan.h"
+#include "faderbank.h"
+#include "main.h"
+#include "usb_midi.h"
+
+// user data lives in the last HAL_STORAGE_SIZE bytes of flash
+#define FLASH_TARGET_OFFSET (PICO_FLASH_SIZE_BYTES - HAL_STORAGE_SIZE)
+
+// the scan gets a hardware alarm (and its IRQ) to itself, so that it runs on
+// whichever core calls faderScanInit() and isn't queued behind other timers.
+#define SCAN_HARDWARE_ALARM 2
+#define SCAN_ALARM_IRQ      TIMER_IRQ_2
+
+// the MIDI IN (device to host) endpoint, as in usb_descriptors.c
+#define USB_MIDI_IN_ENDPOINT 0x81
+
+static void *midi_uart_instance;
+
+/*
+ * time
+ */
+
+uint32_t halMicros() {
+  return time_us_32();
+}
+
+void halSleepUs(uint32_t us) {
+  sleep_us(us);
+}
+
+/*
+ * LED
+ */
+
+void halLedInit() {
+  gpio_init(Board::ledPin);
+  gpio_set_dir(Board::ledPin, GPIO_OUT);
+}
+
+void halLedSet(bool on) {
+  gpio_put(Board::ledPin, on);
+}
+
+/*
+ * Fader scan
+ *
+ * - mux address goes out via a masked GPIO write
+ * - a single conversion is triggered with START_ONCE; oversampled dwells run
+ *   the ADC free-running (START_MANY) instead
+ * - the ADC FIFO raises DREQ for each result, and a DMA channel, re-armed for
+ *   each dwell, moves exactly the requested number of results into the
+ *   sample buffer, so no CPU time is spent waiting on the ADC.
+ * - the alarm IRQ handler and everything it calls run from RAM (the SDK calls
+ *   are all inline register accesses), and it is installed directly rather
+ *   than through an alarm pool, whose dispatch code lives in flash. So with
+ *   CORE1_SCANNING the scan is unaffected by core0 writing to flash.
+ */
+
+class Rp2040ScanHardware final : public ScanHardware {
+  public:
+  void init() {
+    // setup mux pins
+    gpio_init_mask(Board::muxMask);
+    gpio_set_dir_out_masked(Board::muxMask);
+
+    // init ADC0 on GPIO26, with results going into the FIFO and raising DREQ
+    adc_init();
+    adc_gpio_init(Board::adcPin);
+    adc_select_input(0);
+    adc_fifo_setup(true, true, 1, false, false);
+    adc_fifo_drain();
+
+    dmaChannel              = dma_claim_unused_channel(true);
+    dma_channel_config conf = dma_channel_get_default_config(dmaChannel);
+    channel_config_set_transfer_data_size(&conf, DMA_SIZE_16);
+    channel_config_set_read_increment(&conf, false);
+    channel_config_set_write_increment(&conf, true);
+    channel_config_set_dreq(&conf, DREQ_ADC);
+    dma_channel_configure(dmaChannel, &conf, NULL, &adc_hw->fifo, 0, false);
+  }
+
+  void HAL_RAM_FUNC(selectMux)(uint8_t address) override {
+    gpio_put_masked(Board::muxMask, (uint32_t)address << Board::firstMuxPin);
+  }
+
+  void HAL_RAM_FUNC(startConversions)(uint16_t *samples, uint8_t count) override {
+    dma_channel_set_write_addr(dmaChannel, samples, false);
+    dma_channel_set_trans_count(dmaChannel, count, true);
+    if (count == 1) {
+      hw_set_bits(&adc_hw->cs, ADC_CS_START_ONCE_BITS);
+    } else {
+      adc_run(true);
+    }
+  }
+
+  void HAL_RAM_FUNC(stopConversions)() override {
+    // a free-running ADC will have started another conversion: stop it, then
+    // abort the DMA in case its count wasn't reached (a conversion still in
+    // flight when the step ran), and throw the extras away - so
+    // startConversions() can assume an idle channel and an empty FIFO
+    adc_run(false);
+    dma_channel_abort(dmaChannel);
+    adc_fifo_drain();
+  }
+
+  private:
+  uint dmaChannel;
+};
+
+static Rp2040ScanHardware scanHardware;
+static FaderScanSequencer<Board, SCAN_OVERSAMPLE> scanSequencer;
+
+static void HAL_RAM_FUNC(faderScanAlarm)() {
+  timer_hw->intr = 1u << SCAN_HARDWARE_ALARM;
+
+  // the alarm only fires on an exact match of the low 32 bits, so if the
+  // target has already gone by when it is armed, disarm it and step again
+  uint32_t nowUs = time_us_32();
+  while (true) {
+    uint32_t targetUs                    = nowUs + scanSequencer.step(scanHardware, nowUs);
+    timer_hw->alarm[SCAN_HARDWARE_ALARM] = targetUs;
+    nowUs                                = time_us_32();
+    if ((int32_t)(targetUs - nowUs) > 0) {
+      break;
+    }
+    timer_hw->armed = 1u << SCAN_HARDWARE_ALARM;
+    timer_hw->intr  = 1u << SCAN_HARDWARE_ALARM;
+  }
+}
+
+void faderScanInit(uint32_t framePeriodUs, uint8_t backgroundDivider) {
+  scanHardware.init();
+  scanSequencer.begin(framePeriodUs, backgroundDivider);
+  hardware_alarm_claim(SCAN_HARDWARE_ALARM);
+  irq_set_exclusive_handler(SCAN_ALARM_IRQ, faderScanAlarm);
+  hw_set_bits(&timer_hw->inte, 1u << SCAN_HARDWARE_ALARM);
+  irq_set_enabled(SCAN_ALARM_IRQ, true);
+  timer_hw->alarm[SCAN_HARDWARE_ALARM] = time_us_32() + SCAN_MIN_GAP_US;
+}
+
+bool HAL_RAM_FUNC(faderScanTakeFrame)(uint16_t *frame, uint32_t *timestampUs, uint16_t *sampledMask) {
+  return scanSequencer.takeFrame(frame, timestampUs, sampledMask);
+}
+
+void HAL_RAM_FUNC(faderScanSetActive)(uint16_t mask) {
+  scanSequencer.setActive(mask);
+}
+
+uint32_t faderScanDwellCount(uint8_t fader) {
+  return scanSequencer.dwellCount(fader);
+}
+
+/*
+ * Flash
+ */
+
+#ifdef CORE1_FLASH_LOCKOUT
+// core1 is paused while we write to flash (see CORE1_FLASH_LOCKOUT in main.h)
+static bool lockoutCore1 = false;
+#endif
+
+// only this core's interrupts are held off: core1 (if it's scanning) runs
+// from RAM, so it carries on regardless - unless it's locked out instead.
+static uint32_t beginFlashOperation() {
+#ifdef CORE1_FLASH_LOCKOUT
+  if (lockoutCore1) {
+    multicore_lockout_start_blocking();
+  }
+#endif
+  return save_and_disable_interrupts();
+}
+
+static void endFlashOperation(uint32_t ints) {
+  restore_interrupts(ints);
+#ifdef CORE1_FLASH_LOCKOUT
+  if (lockoutCore1) {
+    multicore_lockout_end_blocking();
+  }
+#endif
+}
+
+void halFlashRead(uint32_t offset, uint8_t *buf, uint32_t length) {
+  // Read the flash using memory-mapped addresses
+  // For that we must skip over the XIP_BASE worth of RAM
+  const uint8_t *readPointer = (const uint8_t *)(XIP_BASE + FLASH_TARGET_OFFSET + offset);
+  for (uint32_t i = 0; i < length; i++) {
+    buf[i] = readPointer[i];
+  }
+}
+
+void halFlashErase(uint32_t offset, uint32_t length) {
+  uint32_t ints = beginFlashOperation();
+  flash_range_erase(FLASH_TARGET_OFFSET + offset, length);
+  endFlashOperation(ints);
+}
+
+void halFlashProgram(uint32_t offset, const uint8_t *buf, uint32_t length) {
+  // a page at a time, so that interrupts (USB, I2C, the scan) get serviced
+  // between pages rather than waiting for the whole record
+  for (uint32_t page = 0; page < length; page += FLASH_PAGE_SIZE) {
+    uint32_t ints = beginFlashOperation();
+    flash_range_program(FLASH_TARGET_OFFSET + offset + page, buf + page, FLASH_PAGE_SIZE);
+    endFlashOperation(ints);
+  }
+}
+
+/*
+ * I2C
+ */
+
+static void initI2cPins() {
+  // GPIO 10 = I2C1 SDA
+  // GPIO 11 = I2C1 SCL
+  gpio_init(Board::i2cSdaPin);
+  gpio_init(Board::i2cSclPin);
+  gpio_set_function(Board::i2cSdaPin, GPIO_FUNC_I2C);
+  gpio_set_function(Board::i2cSclPin, GPIO_FUNC_I2C);
+  gpio_pull_up(Board::i2cSdaPin);
+  gpio_pull_up(Board::i2cSclPin);
+}
+
+// Our handler is called from the I2C ISR, so it must complete quickly. Blocking calls /
+// printing to stdio may interfere with interrupt handling.
+static void i2c_slave_handler(i2c_inst_t *i2c, i2c_slave_event_t event) {
+  uint8_t response[16]; // the TX FIFO's depth
+  size_t space;
+  uint8_t length;
+
+  switch (event) {
+  case I2C_SLAVE_RECEIVE: // master has written some data
+    i2cFollowerReceive(i2c_read_byte_raw(i2c));
+    break;
+  case I2C_SLAVE_REQUEST: // master is requesting data
+    // fill the (empty) TX FIFO with as much of the response as it holds, so
+    // the master can clock it out without waiting on us again
+    space  = i2c_get_write_available(i2c);
+    length = i2cFollowerRequest(response, space < sizeof(response) ? space : sizeof(response));
+    for (uint8_t i = 0; i < length; i++) {
+      i2c_write_byte_raw(i2c, response[i]);
+    }
+    break;
+  case I2C_SLAVE_FINISH: // master has signalled Stop / Restart
+    i2cFollowerFinish();
+    break;
+  default:
+    break;
+  }
+}
+
+static uint32_t i2cLeaderBaudrate;
+static bool i2cWriteActive = false;
+static int i2cWriteLength;
+
+void halI2cInitLeader(uint32_t baudrate) {
+  initI2cPins();
+  i2c_init(i2c1, baudrate);
+  i2cLeaderBaudrate = baudrate;
+  i2cWriteActive    = false;
+}
+
+void halI2cInitFollower(uint8_t address, uint32_t baudrate) {
+  initI2cPins();
+  i2c_init(i2c1, baudrate);
+  // configure I2C1 for slave mode
+  i2c_slave_init(i2c1, address, &i2c_slave_handler);
+}
+
+// The whole write goes into the controller's 16-entry TX FIFO at once, STOP
+// flagged on the last byte, and the hardware clocks it out on its own; we
+// only look at the raw interrupt status to see how it ended.
+bool halI2cWriteStart(uint8_t address, const uint8_t *data, size_t length) {
+  i2c_hw_t *hw = i2c_get_hw(i2c1);
+  if (i2cWriteActive || length == 0 || length > HAL_I2C_MAX_WRITE) {
+    return false;
+  }
+
+  // the target address can only change with the controller disabled
+  hw->enable = 0;
+  hw->tar    = address;
+  hw->enable = 1;
+  hw->clr_tx_abrt;
+  hw->clr_stop_det;
+
+  for (size_t i = 0; i < length; i++) {
+    hw->data_cmd = data[i] | (i == length - 1 ? I2C_IC_DATA_CMD_STOP_BITS : 0);
+  }
+  i2cWriteActive = true;
+  i2cWriteLength = length;
+  return true;
+}
+
+int halI2cWritePoll() {
+  i2c_hw_t *hw = i2c_get_hw(i2c1);
+  if (!i2cWriteActive) {
+    return 0;
+  }
+
+  uint32_t status = hw->raw_intr_stat;
+  if (!(status & I2C_IC_RAW_INTR_STAT_STOP_DET_BITS)) {
+    return HAL_I2C_BUSY;
+  }
+  // a NAK aborts the write, and the controller sends STOP: both are done
+  // once STOP has gone out
+  hw->clr_stop_det;
+  i2cWriteActive = false;
+  if (status & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS) {
+    hw->clr_tx_abrt;
+    return -1;
+  }
+  return i2cWriteLength;
+}
+
+void halI2cWriteAbort() {
+  // a follower holding SCL low can stop the controller ever finishing
+  // (even an abort), so reset it outright
+  i2c_deinit(i2c1);
+  i2c_init(i2c1, i2cLeaderBaudrate);
+  i2cWriteActive = false;
+}
+
+/*
+ * USB MIDI
+ */
+
+void halUsbInit() {
+  tusb_init();
+}
+
+void halUsbTask() {
+  tud_task();
+}
+
+bool halUsbMidiAvailable() {
+  return tud_midi_available();
+}
+
+uint32_t halUsbMidiRead(uint8_t *buf, uint32_t maxLength) {
+  return tud_midi_stream_read(buf, maxLength);
+}
+
+uint32_t halUsbMidiWrite(const uint8_t *buf, uint32_t length) {
+  uint8_t cable_num = 0;
+  return tud_midi_stream_write(cable_num, buf, length);
+}
+
+// Packets go straight into the TX FIFO, with nothing to re-parse.
+// tud_midi_n_packet_write() flushes after every packet, which on an idle
+// endpoint would start a transfer holding only the first, so the endpoint
+// is claimed for the length of the batch: those flushes find it taken and
+// do nothing, and one flush at the end sends the lot. (If a transfer is
+// already under way the claim fails, and the batch queues behind it anyway.)
+// Should the FIFO fill while it's held, what's in it goes first.
+static void flushUsbMidi() {
+  uint8_t none;
+  tud_midi_n_stream_write(0, USB_MIDI_CABLE, &none, 0); // writes nothing, then flushes
+}
+
+uint32_t halUsbMidiWritePackets(const uint8_t *packets, uint32_t count) {
+  bool held        = usbd_edpt_claim(0, USB_MIDI_IN_ENDPOINT);
+  uint32_t written = 0;
+  while (written < count) {
+    if (tud_midi_n_packet_write(0, packets + written * USB_MIDI_PACKET_SIZE)) {
+      written++;
+    } else if (held) {
+      usbd_edpt_release(0, USB_MIDI_IN_ENDPOINT);
+      held = false;
+      flushUsbMidi();
+    } else {
+      break;
+    }
+  }
+  if (held) {
+    usbd_edpt_release(0, USB_MIDI_IN_ENDPOINT);
+  }
+  flushUsbMidi();
+  return written;
+}
+
+/*
+ * TRS MIDI
+ */
+
+void halUartMidiInit() {
+  midi_uart_instance = midi_uart_configure(MIDI_UART_NUM, MIDI_UART_TX_GPIO, MIDI_UART_RX_GPIO);
+}
+
+uint32_t halUartMidiWrite(const uint8_t *buf, uint32_t length) {
+  return midi_uart_write_tx_buffer(midi_uart_instance, buf, length);
+}
+
+void halUartMidiDrain() {
+  midi_uart_drain_tx_buffer(midi_uart_instance);
+}
+
+/*
+ * core1
+ */
+
+#ifdef CORE1_FLASH_LOCKOUT
+static void (*core1Entry)();
+
+static void core1Trampoline() {
+  multicore_lockout_victim_init();
+  lockoutCore1 = true;
+  core1Entry();
+}
+
+void halLaunchCore1(void (*entry)()) {
+  core1Entry = entry;
+  multicore_launch_core1(core1Trampoline);
+}
+#else
+void halLaunchCore1(void (*entry)()) {
+  multicore_launch_core1(entry);
+}
+#endif
@@ -1,83 +1,243 @@
-#include <pico/stdio.h>
-#include <pico/stdlib.h>
-#include "hardware/i2c.h"
-
 #include "i2c_utils.h"
 
-uint8_t device              = 0;
-uint8_t port                = 0;
+#include "hal.h"
+#include "latency.h"
+#include "main.h"
 
 // leader i2c specific stuff
 const int ansibleI2Caddress = 0x20;
 const int er301I2Caddress   = 0x31;
 const int txoI2Caddress     = 0x60;
-bool er301Present           = false;
-bool ansiblePresent         = false;
-bool txoPresent             = false;
-
-// enumerate over all things on i2c bus. If they respond, set a flag
-void scanI2Cbus() {
-  int ret;
-  uint8_t txdata = 0x00;
-
-  for (uint8_t addr = 8; addr < 120; addr++) {
-    ret = i2c_write_timeout_us(i2c1, addr, &txdata, 1, false, 100);
 
-    if (ret >= 0) {
-      if (addr == ansibleI2Caddress) {
-        ansiblePresent = true;
-      }
+/*
+ * Leader output. Every fader value goes to every device that's there, but
+ * rather than writing them as they happen, each target address keeps a mask
+ * of the channels it has a value waiting for, and i2cLeaderTask() sends them
+ * one write at a time, never waiting on the bus: a newer value simply
+ * replaces the waiting one. A target that NAKs, or doesn't finish a write
+ * within I2C_WRITE_TIMEOUT_US, is left alone for a while (doubling from
+ * I2C_BACKOFF_MIN_MS up to I2C_BACKOFF_MAX_MS); its values stay queued for
+ * when it's back.
+ *
+ * Discovery shares the bus: every address we could talk to is probed with a
+ * one-byte write - all of them straight away at startup, then whichever
+ * aren't there, one every I2C_DISCOVERY_INTERVAL_MS / I2C_MAX_TARGETS. A
+ * device that answers is sent every current value; one that fails
+ * I2C_MAX_FAILURES writes in a row is taken to have gone, until it answers
+ * a probe again. So modules can be powered (or plugged in) in any order.
+ */
 
-      if (addr == txoI2Caddress) {
-        txoPresent = true;
-      }
+struct I2cTarget {
+  uint8_t address;
+  uint8_t command;
+  uint8_t portMask;    // channel -> port on the device
+  uint16_t channels;   // the channels it takes
+  bool present;        // answered a probe, and hasn't gone since
+  bool probed;         // has been probed at least once
+  uint16_t pending;    // channels with a value waiting
+  uint8_t nextChannel; // round-robin cursor over them
+  uint8_t failures;    // in a row
+  uint32_t retryAt;    // when backing off, when to try again (halMicros)
+};
+
+// four TXos, one ER-301, four Ansibles (at every other address)
+#define I2C_MAX_TARGETS 9
+
+static I2cTarget targets[I2C_MAX_TARGETS];
+static uint8_t targetCount = 0;
+static uint16_t values[FADER_COUNT]; // newest value for each channel
+static uint16_t haveValues = 0;      // channels that have one yet
+#ifdef LATENCY_INSTRUMENTATION
+static uint32_t origins[FADER_COUNT]; // scan each came from
+#endif
+
+static uint8_t nextTarget = 0; // round-robin cursors
+static uint8_t nextProbe  = 0;
+static uint32_t nextProbeAt;   // when the next absent target is due a probe
+static int8_t inFlight = -1;   // target being written to, or -1
+static bool inFlightProbe;
+static uint8_t inFlightChannel;
+static uint32_t inFlightDeadline;
+static I2cLeaderStats stats;
+
+static void addTarget(uint8_t address, uint8_t command, uint8_t portMask, uint16_t channels) {
+  I2cTarget &target  = targets[targetCount++];
+  target.address     = address;
+  target.command     = command;
+  target.portMask    = portMask;
+  target.channels    = channels;
+  target.present     = false;
+  target.probed      = false;
+  target.pending     = 0;
+  target.nextChannel = 0;
+  target.failures    = 0;
+}
 
-      if (addr == er301I2Caddress) {
-        er301Present = true;
-      }
-    }
+void i2cLeaderInit() {
+  // for 4 output devices: channel / 4 picks the device, channel % 4 the port
+  targetCount = 0;
+  for (uint8_t device = 0; device < FADER_COUNT / 4; device++) {
+    addTarget(txoI2Caddress + device, 0x11, 0x03, 0x000F << (device * 4));
+    addTarget(ansibleI2Caddress + (device << 1), 0x06, 0x03, 0x000F << (device * 4));
   }
+  // the ER-301 takes all 16, as ports 0-15
+  addTarget(er301I2Caddress, 0x11, 0x0F, 0xFFFF);
+
+  inFlight    = -1;
+  nextProbeAt = halMicros();
 }
 
 void sendToAllI2C(uint8_t channel, uint16_t value) {
   // we send out to all three supported i2c slave devices
   // keeps the firmware simple :)
+  values[channel] = value;
+  haveValues     |= 1 << channel;
+  LATENCY_STAMP(origins[channel]);
+  for (uint8_t t = 0; t < targetCount; t++) {
+    if (targets[t].present) {
+      targets[t].pending |= targets[t].channels & (1 << channel);
+    }
+  }
+}
+
+// a write has finished (or been given up on)
+static void finishWrite(bool ok) {
+  I2cTarget &target = targets[inFlight];
+  inFlight          = -1;
+
+  if (inFlightProbe) {
+    if (ok) {
+      // it's (back) on the bus: bring it up to date
+      target.present  = true;
+      target.failures = 0;
+      target.pending  = target.channels & haveValues;
+    }
+    return;
+  }
 
-  // for 4 output devices
-  port   = channel % 4;
-  device = channel / 4;
+  if (ok) {
+    target.failures = 0;
+    return;
+  }
+  if (++target.failures >= I2C_MAX_FAILURES) {
+    // it's gone; over to discovery
+    target.present = false;
+    target.pending = 0;
+    return;
+  }
+  // try it again once the target's had a rest, unless there's newer by then
+  target.pending    |= 1 << inFlightChannel;
+  uint32_t backoffMs = I2C_BACKOFF_MIN_MS << (target.failures - 1);
+  if (backoffMs > I2C_BACKOFF_MAX_MS) {
+    backoffMs = I2C_BACKOFF_MAX_MS;
+  }
+  target.retryAt = halMicros() + backoffMs * 1000;
+}
 
-  // TXo
-  if (txoPresent) {
-    sendi2c(txoI2Caddress, device, 0x11, port, value);
+static bool startWrite(uint8_t t, const uint8_t *message, uint8_t length, bool probe) {
+  if (!halI2cWriteStart(targets[t].address, message, length)) {
+    return false;
   }
+  inFlight         = t;
+  inFlightProbe    = probe;
+  inFlightDeadline = halMicros() + I2C_WRITE_TIMEOUT_US;
+  return true;
+}
 
-  // ER-301
-  if (er301Present) {
-    sendi2c(er301I2Caddress, 0, 0x11, channel, value);
+// probe the next target that isn't there, if one's due. Returns true if
+// the bus is taken.
+static bool startProbe() {
+  if (!halTimeReached(nextProbeAt)) {
+    return false;
   }
+  for (uint8_t n = 0; n < targetCount; n++) {
+    uint8_t t         = (nextProbe + n) % targetCount;
+    I2cTarget &target = targets[t];
+    if (target.present) {
+      continue;
+    }
 
-  // ANSIBLE
-  if (ansiblePresent) {
-    sendi2c(ansibleI2Caddress, device << 1, 0x06, port, value);
+    uint8_t probe = 0x00;
+    if (!startWrite(t, &probe, 1, true)) {
+      return true; // the bus is busy; try again next time
+    }
+    // until everything's been probed once, they go back to back
+    bool firstPass = !target.probed;
+    target.probed  = true;
+    nextProbe      = (t + 1) % targetCount;
+    nextProbeAt    = halMicros() + (firstPass ? 0 : I2C_DISCOVERY_INTERVAL_MS * 1000 / I2C_MAX_TARGETS);
+    return true;
   }
+  // everything's there
+  nextProbeAt = halMicros() + I2C_DISCOVERY_INTERVAL_MS * 1000 / I2C_MAX_TARGETS;
+  return false;
 }
 
-/*
- * Sends an i2c command out to a slave when running in leader mode
- */
+void i2cLeaderTask() {
+  if (inFlight >= 0) {
+    int result = halI2cWritePoll();
+    if (result == HAL_I2C_BUSY) {
+      if (!halTimeReached(inFlightDeadline)) {
+        return;
+      }
+      halI2cWriteAbort();
+      result = -1;
+      if (!inFlightProbe) {
+        stats.timeouts++;
+      }
+    } else if (result < 0 && !inFlightProbe) {
+      stats.naks++;
+    }
+    finishWrite(result >= 0);
+  }
 
-void sendi2c(uint8_t model, uint8_t deviceIndex, uint8_t cmd, uint8_t devicePort, int value) {
+  if (startProbe()) {
+    return;
+  }
 
-  uint8_t messageBuffer[4];
-  uint16_t valueTemp;
+  // the next target with something waiting that isn't backing off
+  for (uint8_t n = 0; n < targetCount; n++) {
+    uint8_t t         = (nextTarget + n) % targetCount;
+    I2cTarget &target = targets[t];
+    if (!target.pending || (target.failures && !halTimeReached(target.retryAt))) {
+      continue;
+    }
 
-  messageBuffer[0] = cmd;
-  messageBuffer[1] = (uint8_t)devicePort;
+    uint8_t channel = target.nextChannel;
+    while (!(target.pending & (1 << channel))) {
+      channel = (channel + 1) % FADER_COUNT;
+    }
+
+    uint8_t message[4];
+    message[0] = target.command;
+    message[1] = channel & target.portMask;
+    message[2] = values[channel] >> 8;
+    message[3] = values[channel] & 0xff;
+    if (!startWrite(t, message, sizeof(message), false)) {
+      return; // the bus is busy; try again next time
+    }
+
+    LATENCY_RECORD_SINCE(LATENCY_I2C, origins[channel]);
+    target.pending    &= ~(1 << channel);
+    target.nextChannel = (channel + 1) % FADER_COUNT;
+    inFlightChannel    = channel;
+    nextTarget         = (t + 1) % targetCount;
+    return;
+  }
+}
 
-  valueTemp        = (uint16_t)value;
-  messageBuffer[2] = valueTemp >> 8;
-  messageBuffer[3] = valueTemp & 0xff;
+I2cLeaderStats i2cLeaderStats() {
+  return stats;
+}
 
-  i2c_write_blocking(i2c1, model + deviceIndex, messageBuffer, 4, false);
+bool i2cLeaderPending() {
+  if (inFlight >= 0) {
+    return true;
+  }
+  for (uint8_t t = 0; t < targetCount; t++) {
+    if (targets[t].pending) {
+      return true;
+    }
+  }
+  return false;
 }
@@ -1,8 +1,22 @@
 #pragma once
 
-#include <pico/stdio.h>
-#include <pico/stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
 
-void scanI2Cbus();
+// start looking for devices; i2cLeaderTask() does the rest
+void i2cLeaderInit();
+// queue a fader value for every device that's there; it's written by
+// i2cLeaderTask(), replacing any older value still waiting
 void sendToAllI2C(uint8_t channel, uint16_t value);
-void sendi2c(uint8_t model, uint8_t deviceIndex, uint8_t cmd, uint8_t devicePort, int value);
+// start the next write (or discovery probe) when the bus is free; never
+// waits for it
+void i2cLeaderTask();
+// is anything waiting to be written (or being written)?
+bool i2cLeaderPending();
+// value writes that were NAKed, or timed out, since boot (probes of devices
+// that aren't there don't count)
+struct I2cLeaderStats {
+  uint32_t naks;
+  uint32_t timeouts;
+};
+I2cLeaderStats i2cLeaderStats();
@@ -0,0 +1,14 @@
+#include "latency.h"
+
+#include <string.h>
+
+#ifdef LATENCY_INSTRUMENTATION
+
+LatencyStats latencyStats[LATENCY_STAGES];
+uint32_t latencyOrigin;
+
+void latencyReset() {
+  memset(latencyStats, 0, sizeof(latencyStats));
+}
+
+#endif
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hal.h"
+#include "main.h"
+
+/*
+ * Latency instrumentation: how old a fader reading is by the time it gets
+ * to each stage of the output path, measured from the start of the scan
+ * that read it.
+ *
+ * - LATENCY_SCAN: the main loop has the frame (ADC conversions, plus any
+ *   wait for the loop to get to it)
+ * - LATENCY_FILTER: the filtered value is out (one per changed fader)
+ * - LATENCY_USB: the frame's USB-MIDI packets are handed to the USB stack
+ * - LATENCY_TRS: a CC is written to the UART (after pacing; the age of the
+ *   value actually sent, so coalescing shows up as freshness)
+ * - LATENCY_I2C: a leader write of the value starts
+ *
+ * Each stage keeps a count, min, mean and max, and a histogram with log2
+ * buckets: bucket 0 is 0us, bucket b is [2^(b-1), 2^b) us, and the last
+ * bucket takes everything longer. A probe is a subtraction and a few adds.
+ *
+ * Compiled in only with LATENCY_INSTRUMENTATION defined (see main.h);
+ * otherwise the LATENCY_* macros are empty and nothing is stored.
+ */
+
+enum LatencyStage : uint8_t {
+  LATENCY_SCAN,
+  LATENCY_FILTER,
+  LATENCY_USB,
+  LATENCY_TRS,
+  LATENCY_I2C,
+  LATENCY_STAGES
+};
+
+#define LATENCY_BUCKETS 16 // up to 16ms; slower than that lands in the last
+
+struct LatencyStats {
+  uint32_t count;
+  uint32_t min;   // us
+  uint32_t max;   // us
+  uint64_t total; // us, for the mean
+  uint32_t buckets[LATENCY_BUCKETS];
+};
+
+#ifdef LATENCY_INSTRUMENTATION
+
+extern LatencyStats latencyStats[LATENCY_STAGES];
+extern uint32_t latencyOrigin; // start of the scan being output
+
+static inline void latencyRecord(uint8_t stage, uint32_t us) {
+  LatencyStats &stats = latencyStats[stage];
+  if (stats.count == 0 || us < stats.min) {
+    stats.min = us;
+  }
+  if (us > stats.max) {
+    stats.max = us;
+  }
+  stats.count++;
+  stats.total    += us;
+  uint8_t bucket  = us ? 32 - __builtin_clz(us) : 0;
+  stats.buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+}
+
+void latencyReset();
+
+// the scan whose values are being output now
+#define LATENCY_ORIGIN(us)                  (latencyOrigin = (us))
+// remember the current origin, for a value that goes out later
+#define LATENCY_STAMP(var)                  ((var) = latencyOrigin)
+#define LATENCY_RECORD(stage)               latencyRecord(stage, halMicros() - latencyOrigin)
+#define LATENCY_RECORD_SINCE(stage, origin) latencyRecord(stage, halMicros() - (origin))
+
+#else
+
+#define LATENCY_ORIGIN(us)                  ((void)0)
+#define LATENCY_STAMP(var)                  ((void)0)
+#define LATENCY_RECORD(stage)               ((void)0)
+#define LATENCY_RECORD_SINCE(stage, origin) ((void)0)
+
+#endif
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Incremental MIDI byte-stream parser.
+ *
+ * parse() takes the stream in whatever chunks it arrives in (a USB read, a
+ * UART byte) and hands complete messages to a MidiHandler as soon as their
+ * last byte is seen, so messages may straddle chunks and one chunk may hold
+ * any number of them:
+ *
+ * - realtime bytes (0xF8-0xFF) are delivered immediately, even in the
+ *   middle of another message, and don't disturb it.
+ * - channel and system common messages are delivered whole, status byte
+ *   first; running status is expanded.
+ * - sysex is collected straight into the parser's own buffer and delivered,
+ *   0xF0 to 0xF7 inclusive, from there - no further copy. A sysex message
+ *   longer than SYSEX_CAPACITY is delivered in parts instead, each as the
+ *   buffer fills, so it can still be passed on. One cut short by another
+ *   status byte is dropped (and counted) - or, if parts of it have already
+ *   gone, ended there with an 0xF7 (and counted).
+ *
+ * Data bytes with no status to belong to are ignored.
+ */
+
+class MidiHandler {
+  public:
+  // a channel or system common message, status byte first (1-3 bytes)
+  virtual void midiMessage(const uint8_t *message, uint8_t length) = 0;
+  // a realtime byte (clock, start, stop...)
+  virtual void midiRealtime(uint8_t status) = 0;
+  // a complete sysex message, 0xF0 to 0xF7. The handler may modify it, but
+  // it's only valid until the call returns.
+  virtual void midiSysex(uint8_t *message, uint16_t length) = 0;
+  // part of a sysex message too long to deliver whole: the first part starts
+  // with 0xF0, and the last (last set) ends with 0xF7. Ignored by default.
+  virtual void midiSysexPart(const uint8_t *data, uint16_t length, bool last) {}
+};
+
+template <uint16_t SYSEX_CAPACITY>
+class MidiParser {
+  static_assert(SYSEX_CAPACITY >= 2, "sysex needs room for at least 0xF0 0xF7");
+
+  public:
+  void reset() {
+    status        = 0;
+    expected      = 0;
+    count         = 0;
+    inSysex       = false;
+    sysexLength   = 0;
+    sysexParts    = false;
+  }
+
+  void parse(const uint8_t *data, uint32_t length, MidiHandler &handler) {
+    for (uint32_t i = 0; i < length; i++) {
+      parseByte(data[i], handler);
+    }
+  }
+
+  inline void parseByte(uint8_t byte, MidiHandler &handler) {
+    if (byte >= 0xF8) {
+      handler.midiRealtime(byte);
+      return;
+    }
+
+    if (inSysex) {
+      if (byte < 0x80) {
+        // the last byte is kept for the 0xF7; when the rest is full, it's
+        // passed on as a part and the buffer starts again
+        if (sysexLength == SYSEX_CAPACITY - 1) {
+          handler.midiSysexPart(sysexBuffer, sysexLength, false);
+          sysexLength = 0;
+          sysexParts  = true;
+        }
+        sysexBuffer[sysexLength++] = byte;
+        return;
+      }
+      // any status byte ends sysex; only 0xF7 ends it properly
+      inSysex                    = false;
+      sysexBuffer[sysexLength++] = 0xF7;
+      if (byte != 0xF7) {
+        droppedSysex++;
+      }
+      if (sysexParts) {
+        handler.midiSysexPart(sysexBuffer, sysexLength, true);
+      } else if (byte == 0xF7) {
+        handler.midiSysex(sysexBuffer, sysexLength);
+      }
+      if (byte == 0xF7) {
+        return;
+      }
+      // and fall through to handle the new status byte
+    }
+
+    if (byte >= 0x80) {
+      startMessage(byte, handler);
+      return;
+    }
+
+    // a data byte
+    if (!status) {
+      return;
+    }
+    message[++count] = byte;
+    if (count == expected) {
+      handler.midiMessage(message, expected + 1);
+      count = 0;
+      if (status >= 0xF0) {
+        status = 0; // no running status for system common
+      }
+    }
+  }
+
+  // sysex messages cut short
+  uint32_t dropped() const {
+    return droppedSysex;
+  }
+
+  private:
+  void startMessage(uint8_t byte, MidiHandler &handler) {
+    count = 0;
+
+    if (byte == 0xF0) {
+      status         = 0;
+      inSysex        = true;
+      sysexParts     = false;
+      sysexBuffer[0] = 0xF0;
+      sysexLength    = 1;
+      return;
+    }
+
+    if (byte < 0xF0) {
+      status   = byte;
+      expected = (byte & 0xF0) == 0xC0 || (byte & 0xF0) == 0xD0 ? 1 : 2;
+    } else {
+      switch (byte) {
+      case 0xF1: // MTC quarter frame
+      case 0xF3: // song select
+        status   = byte;
+        expected = 1;
+        break;
+      case 0xF2: // song position
+        status   = byte;
+        expected = 2;
+        break;
+      case 0xF6: // tune request
+        status = 0;
+        handler.midiMessage(&byte, 1);
+        return;
+      default: // a stray 0xF7, or undefined
+        status = 0;
+        return;
+      }
+    }
+    message[0] = byte;
+  }
+
+  uint8_t status   = 0; // current (running) status, or 0
+  uint8_t expected = 0; // data bytes the current status takes
+  uint8_t count    = 0; // data bytes seen so far
+  uint8_t message[3];
+
+  bool inSysex          = false;
+  bool sysexParts       = false; // the current sysex is being delivered in parts
+  uint16_t sysexLength  = 0;
+  uint32_t droppedSysex = 0;
+  uint8_t sysexBuffer[SYSEX_CAPACITY];
+};
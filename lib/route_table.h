@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+#include "config.h"
+
+/*
+ * The config, compiled into what the output path needs per fader.
+ *
+ * Each physical fader gets one FaderRoute: a list of outputs, with
+ * everything that used to be worked out per fader per scan already
+ * resolved. Its USB and TRS CCs come first, then each port of each of its
+ * extra destinations (the routing matrix), so a destination sent to both
+ * ports is two outputs. Each output has the control's status byte (channel
+ * and message type), CC or NRPN parameter number, how far to shift a 14-bit
+ * value for its resolution, and the XOR mask that inverts it when the
+ * faderbank is rotated. Sending a value is then, per output, a shift, a
+ * compare, an XOR and a switch on the type; the fan-out costs only the
+ * messages themselves.
+ *
+ * Every scene has a table of its own, compiled ahead of time, so switching
+ * scenes is a single store: select() just makes another table current.
+ * build() compiles a scene into the spare buffer, then swaps it in for the
+ * scene's old one (which becomes the spare), so a config edit never leaves
+ * the output path with half a table. The output path only holds current()
+ * for the length of one fader's output, so one spare is enough.
+ */
+
+#define ROUTE_USB 0
+#define ROUTE_TRS 1
+#define ROUTE_MAX_OUTPUTS (2 + 2 * FADER_DESTINATIONS)
+// of which at most this many go to TRS: its TRS CC, and one per destination
+#define ROUTE_MAX_TRS_OUTPUTS (1 + FADER_DESTINATIONS)
+
+struct RouteOutput {
+  uint8_t type;    // DESTINATION_CC7 ...
+  uint8_t port;    // ROUTE_USB or ROUTE_TRS
+  uint8_t status;  // 0xB0 | channel, or 0xE0 | channel for pitch bend
+  uint8_t shift;   // 0 for 14-bit, 7 for 7-bit
+  uint16_t number; // CC or NRPN parameter
+  uint16_t invert; // XORed with the shifted value
+};
+
+struct FaderRoute {
+  RouteOutput outputs[ROUTE_MAX_OUTPUTS];
+  uint8_t outputCount;
+  uint16_t i2cInvert; // I2C is always 14-bit
+};
+
+template <uint8_t N, uint8_t SCENES>
+class RouteTable {
+  public:
+  RouteTable() {
+    for (uint8_t scene = 0; scene < SCENES; scene++) {
+      tables[scene] = scene;
+    }
+  }
+
+  // compile every scene
+  void build(const ControllerConfig &config) {
+    for (uint8_t scene = 0; scene < SCENES; scene++) {
+      build(config, scene);
+    }
+  }
+
+  void build(const ControllerConfig &config, uint8_t scene) {
+    uint8_t next = spare;
+    for (uint8_t i = 0; i < N; i++) {
+      compile(routes[next][i], config, config.scenes[scene], config.rotated ? N - 1 - i : i);
+    }
+    spare         = tables[scene];
+    tables[scene] = next;
+    if (scene == selected) {
+      active.store(next, std::memory_order_release);
+    }
+  }
+
+  // make a scene's table current
+  void select(uint8_t scene) {
+    selected = scene;
+    active.store(tables[scene], std::memory_order_release);
+  }
+
+  // the current table, indexed by physical fader
+  const FaderRoute *current() const {
+    return routes[active.load(std::memory_order_acquire)];
+  }
+
+  private:
+  static void compile(FaderRoute &route, const ControllerConfig &config, const SceneConfig &scene, uint8_t control) {
+    uint16_t invert14 = config.rotated ? (1 << 14) - 1 : 0;
+    uint16_t invert7  = config.rotated ? (1 << 7) - 1 : 0;
+
+    // high resolution puts the LSB on CC + 32; from CC 96 up there's no
+    // such CC, so those stay 7-bit
+    bool usbHighRes = scene.usbHighResolution[control] && scene.usbCCs[control] + 32 <= 127;
+    bool trsHighRes = scene.trsHighResolution[control] && scene.trsCCs[control] + 32 <= 127;
+
+    route.outputCount = 0;
+    addOutput(route, ROUTE_USB, usbHighRes ? DESTINATION_CC14 : DESTINATION_CC7, scene.usbMidiChannels[control],
+              scene.usbCCs[control], invert14, invert7);
+    addOutput(route, ROUTE_TRS, trsHighRes ? DESTINATION_CC14 : DESTINATION_CC7, scene.trsMidiChannels[control],
+              scene.trsCCs[control], invert14, invert7);
+
+    for (uint8_t d = 0; d < FADER_DESTINATIONS; d++) {
+      const FaderDestination &destination = scene.destinations[control][d];
+      if (destination.type == DESTINATION_NONE) {
+        continue;
+      }
+      if (destination.ports & DESTINATION_USB) {
+        addOutput(route, ROUTE_USB, destination.type, destination.channel, destination.number, invert14, invert7);
+      }
+      if (destination.ports & DESTINATION_TRS) {
+        addOutput(route, ROUTE_TRS, destination.type, destination.channel, destination.number, invert14, invert7);
+      }
+    }
+
+    route.i2cInvert = invert14;
+  }
+
+  static void addOutput(FaderRoute &route, uint8_t port, uint8_t type, uint8_t channel, uint16_t number,
+                        uint16_t invert14, uint16_t invert7) {
+    RouteOutput &output = route.outputs[route.outputCount++];
+    bool highRes        = type != DESTINATION_CC7;
+    output.type         = type;
+    output.port         = port;
+    output.status       = (type == DESTINATION_PITCH_BEND ? 0xE0 : 0xB0) | ((channel - 1) & 0x0F);
+    output.shift        = highRes ? 0 : 7;
+    output.number       = number;
+    output.invert       = highRes ? invert14 : invert7;
+  }
+
+  FaderRoute routes[SCENES + 1][N] = {};
+  uint8_t tables[SCENES];    // the buffer holding each scene's table
+  uint8_t spare    = SCENES; // the buffer that isn't
+  uint8_t selected = 0;
+  std::atomic<uint8_t> active{0};
+};
@@ -1,31 +1,22 @@
 #include "sysex.h"
 
 #include "config.h"
-#include "flash_onboard.h"
+#include "config_store.h"
+#include "hal.h"
 #include "main.h"
-#include "tusb.h"
 
-bool copySysexStreamToBuffer(uint8_t *syxBuffer, uint8_t *inputBuffer, uint8_t streamLength, uint8_t runningOffset) {
-  bool sysexComplete = false;
+static uint32_t shortWrites = 0;
 
-  for (uint8_t i = 0; i < streamLength; i++) {
-    syxBuffer[i + runningOffset] = inputBuffer[i];
-    if (inputBuffer[i] == 0xF7) {
-      sysexComplete = true;
-      break;
-    }
-  }
-  return sysexComplete;
-}
-
-void sendCurrentConfig() {
+void sendCurrentConfig(uint8_t scene) {
   // current Data length = memory + 3 bytes for firmware version + 1 byte for device ID
   uint8_t configDataLength = 4 + MEMORY_MAP_LENGTH;
   uint8_t currentConfigData[configDataLength];
 
-  // read 86 bytes from internal flash
+  // the scene's stored config, from the config store's RAM image, with
+  // the scene it is in the (otherwise unused) byte 10
   uint8_t buf[MEMORY_MAP_LENGTH];
-  readFlash(buf, MEMORY_MAP_LENGTH);
+  loadMemoryMap(scene, buf);
+  buf[10] = scene;
 
   // build a message from the version number...
   currentConfigData[0] = DEVICE_INDEX;
@@ -42,6 +33,56 @@ void sendCurrentConfig() {
   sendByteArrayAsSysex(0x0F, currentConfigData, configDataLength);
 }
 
+void sendCalibration(uint8_t fader, const FaderCalibration *calibration) {
+  uint8_t data[4 + 1 + CALIBRATION_FADER_LENGTH];
+  data[0] = DEVICE_INDEX;
+  data[1] = FIRMWARE_VERSION_MAJOR;
+  data[2] = FIRMWARE_VERSION_MINOR;
+  data[3] = FIRMWARE_VERSION_POINT;
+  data[4] = fader;
+  encodeCalibration(calibration, data + 5);
+
+  // 0x08 == calibr8ion
+  sendByteArrayAsSysex(0x08, data, sizeof(data));
+}
+
+void sendDestinations(uint8_t control, const FaderDestination *destinations) {
+  uint8_t data[4 + 1 + FADER_DESTINATIONS * DESTINATION_LENGTH];
+  data[0] = DEVICE_INDEX;
+  data[1] = FIRMWARE_VERSION_MAJOR;
+  data[2] = FIRMWARE_VERSION_MINOR;
+  data[3] = FIRMWARE_VERSION_POINT;
+  data[4] = control;
+  encodeDestinations(destinations, data + 5);
+
+  // 0x07 == rou7es
+  sendByteArrayAsSysex(0x07, data, sizeof(data));
+}
+
+void sendCountersAsSysex(uint8_t messageId, const uint32_t *counters, uint8_t count) {
+  uint8_t dataLength = 5 + count * 5;
+  uint8_t data[dataLength];
+
+  data[0] = DEVICE_INDEX;
+  data[1] = FIRMWARE_VERSION_MAJOR;
+  data[2] = FIRMWARE_VERSION_MINOR;
+  data[3] = FIRMWARE_VERSION_POINT;
+  data[4] = count;
+
+  // 32 bits go in five 7-bit bytes; the top one only holds 4
+  for (uint8_t i = 0; i < count; i++) {
+    for (uint8_t b = 0; b < 5; b++) {
+      data[5 + i * 5 + b] = (counters[i] >> (7 * (4 - b))) & 0x7F;
+    }
+  }
+
+  sendByteArrayAsSysex(messageId, data, dataLength);
+}
+
+uint32_t sysexShortWrites() {
+  return shortWrites;
+}
+
 void sendByteArrayAsSysex(uint8_t messageId, uint8_t *byteArray,
                           uint8_t byteArrayLength) {
   uint8_t outputMessageLength =
@@ -75,6 +116,8 @@ void sendByteArrayAsSysex(uint8_t messageId, uint8_t *byteArray,
     for (uint8_t i = 0; i < chunkLength; i++) {
       tempBuf[i] = outputMessage[offset + i];
     }
-    tud_midi_stream_write(0, tempBuf, chunkLength);
+    if (halUsbMidiWrite(tempBuf, chunkLength) < chunkLength) {
+      shortWrites++;
+    }
   }
 }
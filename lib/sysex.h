@@ -1,10 +1,19 @@
 #pragma once
 
-#include <pico/stdio.h>
-#include <pico/stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
 
-// void processSysexBuffer();
-// void copySysexStreamToBuffer(uint8_t* inputBuffer, uint8_t streamLength);
 void sendByteArrayAsSysex(uint8_t messageId, uint8_t *byteArray, uint8_t byteArrayLength);
-void sendCurrentConfig();
-bool copySysexStreamToBuffer(uint8_t *syxBuffer, uint8_t *inputBuffer, uint8_t streamLength, uint8_t runningOffset);
+// send a scene's memory map
+void sendCurrentConfig(uint8_t scene);
+// send one fader's calibration
+void sendCalibration(uint8_t fader, const FaderCalibration *calibration);
+// send one control's destinations
+void sendDestinations(uint8_t control, const FaderDestination *destinations);
+// send counters as sysex: the device ID and firmware version, how many
+// counters, then each as five 7-bit bytes, most significant first
+void sendCountersAsSysex(uint8_t messageId, const uint32_t *counters, uint8_t count);
+// sysex chunks the USB stack didn't take all of, since boot
+uint32_t sysexShortWrites();
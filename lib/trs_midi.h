@@ -0,0 +1,505 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hal.h"
+#include "latency.h"
+#include "main.h"
+
+/*
+ * TRS MIDI output stage.
+ *
+ * The TRS port moves one byte every TRS_MIDI_BYTE_US (320us at 31250 baud),
+ * far slower than the faders can change, so nothing is written to the UART
+ * as it happens. Everything queues here, and encode() writes as much as the
+ * link has room for:
+ *
+ * - MIDI thru messages wait in a FIFO, in arrival order, and go first. A
+ *   message is never interleaved with anything else once it has started -
+ *   except for realtime bytes (clock, start, stop...), which MIDI allows
+ *   anywhere, even inside a sysex. They jump the queue, so a clock isn't
+ *   held up behind a long dump. A sysex too long to hold whole is queued a
+ *   part at a time as it arrives (writeThruPart()), and the fader values
+ *   wait until its last part has gone.
+ * - fader values wait in a table with at most one entry per control: a
+ *   (channel, CC), a (channel, NRPN parameter) or a channel's pitch bend. A
+ *   newer value overwrites the queued one in place, keeping its place in
+ *   line, so however fast the faders move, the queue never holds more than
+ *   one message per control - and under saturation the port carries the
+ *   latest positions, rather than falling further and further behind.
+ *   When the controls change (a new scene or config), retire() marks the
+ *   ones queued so far, and if the table fills up they make way for the new
+ *   ones; a live control's value never does.
+ *
+ * The room is a token bucket standing in for the UART's TX space: credit
+ * accrues at one byte per TRS_MIDI_BYTE_US, up to TRS_MIDI_BURST_BYTES, and
+ * every byte written spends it.
+ *
+ * To make the most of the bytes that do go out:
+ * - running status: a message on the same channel as the last one skips its
+ *   status byte. Values with the running status may go ahead of older ones,
+ *   but only so far: none is passed over more than TRS_MIDI_MAX_SKIPS times.
+ * - in 14-bit mode, the MSB is only sent when it changes: an LSB on its
+ *   own updates the low half of a 14-bit controller. NRPN data entry (CCs 6
+ *   and 38) works the same way.
+ * - an NRPN only selects its parameter (CCs 99 and 98) when it isn't the
+ *   one last selected on its channel. Thru messages that select an (N)RPN
+ *   are watched for, so it's never wrongly assumed.
+ * - a value that ends up back at the one last sent sends nothing.
+ */
+
+#define TRS_MIDI_THRU_SIZE 512    // bytes of queued thru
+#define TRS_MIDI_THRU_SEGMENT 127 // most thru bytes stored behind one header
+#define TRS_MIDI_REALTIME_SIZE 16 // queued realtime thru bytes
+#define TRS_MIDI_MAX_SKIPS 32     // times a value can be passed over for running status
+#define TRS_MIDI_NO_NRPN   0xFFFF // no parameter known to be selected
+
+// CAPACITY: how many controls are tracked at once; make it at least the
+// most the routes can send to TRS, so that every live control has an entry
+template <uint8_t CAPACITY>
+class TrsMidiEncoder {
+  public:
+  void begin(uint32_t nowUs) {
+    entryCount    = 0;
+    thruHead      = 0;
+    thruTail      = 0;
+    thruMessage   = 0;
+    thruOpen      = false;
+    thruSkipping  = false;
+    thruWireOpen  = false;
+    realtimeHead  = 0;
+    realtimeTail  = 0;
+    runningStatus = 0;
+    nextStamp     = 0;
+    credit        = TRS_MIDI_BURST_BYTES * TRS_MIDI_BYTE_US;
+    lastUs        = nowUs;
+    droppedThru   = 0;
+    forgetNrpns();
+  }
+
+  // the newest value for a CC (status: 0xB0 | channel), 7 or 14 bits wide
+  void setControlChange(uint8_t status, uint8_t cc, uint16_t value, bool highResolution) {
+    set(status, CONTROL_CC, cc, value, highResolution);
+  }
+
+  // the newest 14-bit value for an NRPN (status: 0xB0 | channel)
+  void setNrpn(uint8_t status, uint16_t parameter, uint16_t value) {
+    set(status, CONTROL_NRPN, parameter, value, true);
+  }
+
+  // the newest 14-bit pitch bend (status: 0xE0 | channel)
+  void setPitchBend(uint8_t status, uint16_t value) {
+    set(status, CONTROL_PITCH_BEND, 0, value, true);
+  }
+
+  // the controls being sent are about to change: what's queued so far may
+  // be dropped, rather than a new control's value, if the table fills up
+  void retire() {
+    for (uint8_t i = 0; i < entryCount; i++) {
+      entries[i].retired = true;
+    }
+  }
+
+  // send every value in full next time, with a status byte (eg, when the
+  // editor asks for every control)
+  void invalidate() {
+    runningStatus = 0;
+    for (uint8_t i = 0; i < entryCount; i++) {
+      entries[i].sentValid = false;
+    }
+    forgetNrpns();
+  }
+
+  // queue a whole message for MIDI thru. If there isn't room for all of it,
+  // it's dropped.
+  void writeThru(const uint8_t *message, uint16_t length) {
+    if (length == 1 && message[0] >= 0xF8) {
+      if ((uint8_t)(realtimeHead - realtimeTail) == TRS_MIDI_REALTIME_SIZE) {
+        droppedThru++;
+        return;
+      }
+      realtime[realtimeHead++ % TRS_MIDI_REALTIME_SIZE] = message[0];
+      return;
+    }
+    if (length == 0 || thruFree() < thruNeeded(length)) {
+      droppedThru++;
+      return;
+    }
+    if (length == 3) {
+      watchSelect(message[0], message[1]);
+    }
+    thruQueue(message, length, false);
+  }
+
+  // queue part of a sysex message too long to queue whole (see
+  // MidiHandler::midiSysexPart); the parts go out back to back. If a part
+  // doesn't fit, the message is ended there with an 0xF7 and the rest of it
+  // is dropped.
+  void writeThruPart(const uint8_t *data, uint16_t length, bool last) {
+    if (thruSkipping) {
+      thruSkipping = !last;
+      return;
+    }
+    // leave room to end the message, should a later part not fit
+    uint16_t reserve = last ? 0 : 2;
+    if (length == 0 || thruFree() < thruNeeded(length) + reserve) {
+      droppedThru++;
+      if (thruOpen) {
+        uint8_t end = 0xF7;
+        thruQueue(&end, 1, false);
+      }
+      thruOpen     = false;
+      thruSkipping = !last;
+      return;
+    }
+    thruQueue(data, length, !last);
+    thruOpen = !last;
+  }
+
+  // bytes of thru that could be queued now
+  uint16_t thruRoom() const {
+    return thruFree();
+  }
+
+  // write as much as there's room for
+  void encode(uint32_t nowUs) {
+    credit += (int32_t)(nowUs - lastUs);
+    lastUs  = nowUs;
+    if (credit > TRS_MIDI_BURST_BYTES * TRS_MIDI_BYTE_US) {
+      credit = TRS_MIDI_BURST_BYTES * TRS_MIDI_BYTE_US;
+    }
+
+    // realtime thru before anything, even in the middle of a message
+    while (credit >= TRS_MIDI_BYTE_US && realtimeHead != realtimeTail) {
+      uint8_t byte = realtime[realtimeTail++ % TRS_MIDI_REALTIME_SIZE];
+      write(&byte, 1);
+    }
+
+    // then the rest of thru, a byte at a time; a message that has started is
+    // finished before anything else goes out, even if it's waiting on parts
+    // that haven't arrived yet
+    while (credit >= TRS_MIDI_BYTE_US && (thruMessage || thruHead != thruTail)) {
+      if (!thruMessage) {
+        uint8_t header = thruPop();
+        thruMessage    = header & TRS_MIDI_THRU_SEGMENT;
+        if (!thruWireOpen) {
+          uint8_t first = thru[thruTail];
+          if (first >= 0x80 && first < 0xF8) {
+            // channel messages set running status; everything else but
+            // realtime cancels it
+            runningStatus = first < 0xF0 ? first : 0;
+          }
+        }
+        thruWireOpen = header & 0x80;
+      }
+      uint8_t byte = thruPop();
+      write(&byte, 1);
+      thruMessage--;
+    }
+    if (thruMessage || thruWireOpen || thruHead != thruTail || realtimeHead != realtimeTail) {
+      return;
+    }
+
+    // then the fader values
+    while (Entry *entry = nextEntry()) {
+      uint8_t message[9];
+      uint8_t length = build(entry, message);
+
+      if (length == 0) {
+        entry->pending = false; // nothing new to say
+        continue;
+      }
+      if (credit < (int32_t)length * TRS_MIDI_BYTE_US) {
+        return;
+      }
+
+      write(message, length);
+      LATENCY_RECORD_SINCE(LATENCY_TRS, entry->origin);
+      entry->pending      = false;
+      entry->sentValue    = entry->value;
+      entry->sentHighRes  = entry->highRes;
+      entry->sentValid    = true;
+      runningStatus       = entry->status;
+      if (entry->control == CONTROL_NRPN) {
+        nrpnParameter[entry->status & 0x0F] = entry->number;
+      } else if (entry->control == CONTROL_CC) {
+        watchSelect(entry->status, entry->number);
+      }
+
+      // everything still waiting was passed over
+      for (uint8_t i = 0; i < entryCount; i++) {
+        if (entries[i].pending && entry->stamp - entries[i].stamp < 0x80000000u) {
+          entries[i].skips++;
+        }
+      }
+    }
+  }
+
+  // is anything still waiting to go out?
+  bool pending() const {
+    if (thruMessage || thruWireOpen || thruHead != thruTail || realtimeHead != realtimeTail) {
+      return true;
+    }
+    for (uint8_t i = 0; i < entryCount; i++) {
+      if (entries[i].pending) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // thru messages dropped for want of room
+  uint32_t dropped() const {
+    return droppedThru;
+  }
+
+  // bytes the UART wouldn't take
+  uint32_t uartDropped() const {
+    return droppedUart;
+  }
+
+  // the most bytes there have been on their way out at once, going by the
+  // pacing's own model of the link (written, and not yet due to be on the
+  // wire): an estimate, as the UART's buffer can't be read
+  uint8_t modelledHighWater() const {
+    return mostOutstanding;
+  }
+
+  private:
+  void write(const uint8_t *bytes, uint8_t length) {
+    uint32_t written = halUartMidiWrite(bytes, length);
+    if (written < length) {
+      droppedUart += length - written;
+    }
+    credit -= (int32_t)length * TRS_MIDI_BYTE_US;
+
+    int32_t outstanding = (TRS_MIDI_BURST_BYTES * TRS_MIDI_BYTE_US - credit) / TRS_MIDI_BYTE_US;
+    if (outstanding > mostOutstanding) {
+      mostOutstanding = outstanding;
+    }
+  }
+
+  enum Control : uint8_t { CONTROL_CC, CONTROL_NRPN, CONTROL_PITCH_BEND };
+
+  void set(uint8_t status, Control control, uint16_t number, uint16_t value, bool highResolution) {
+    Entry *entry = find(status, control, number);
+    if (!entry) {
+      return; // the table is full of live controls (see find())
+    }
+    entry->retired = false;
+    if (!entry->pending) {
+      entry->pending = true;
+      entry->stamp   = nextStamp++;
+      entry->skips   = 0;
+    }
+    entry->value   = value;
+    entry->highRes = highResolution;
+    LATENCY_STAMP(entry->origin);
+  }
+
+  // a CC that selects an (N)RPN leaves us not knowing which NRPN is selected
+  void watchSelect(uint8_t status, uint8_t cc) {
+    if ((status & 0xF0) == 0xB0 && cc >= 98 && cc <= 101) {
+      nrpnParameter[status & 0x0F] = TRS_MIDI_NO_NRPN;
+    }
+  }
+
+  void forgetNrpns() {
+    for (uint8_t channel = 0; channel < 16; channel++) {
+      nrpnParameter[channel] = TRS_MIDI_NO_NRPN;
+    }
+  }
+
+  struct Entry {
+    uint8_t status;
+    Control control;
+    uint16_t number;  // CC or NRPN parameter
+    bool pending;     // value is waiting to go out
+    bool retired;     // queued before the controls last changed
+    bool highRes;
+    uint16_t value;   // newest value
+    uint32_t stamp;   // when it started waiting: its place in line
+    uint8_t skips;    // times something newer went ahead of it
+    bool sentValid;   // sentValue/sentHighRes are what the receiver has
+    bool sentHighRes;
+    uint16_t sentValue;
+#ifdef LATENCY_INSTRUMENTATION
+    uint32_t origin;  // scan the value came from
+#endif
+  };
+
+  // the entry for a control, making one if need be. A full table reuses
+  // an entry with nothing waiting (forgetting what it last sent), or failing
+  // that the oldest retired one. A live control's waiting value is never
+  // given up for another's: if there's neither, there's no entry (nullptr).
+  // That can't happen while CAPACITY covers every control the routes can
+  // send, as it does for the faderbank's own queue.
+  Entry *find(uint8_t status, Control control, uint16_t number) {
+    for (uint8_t i = 0; i < entryCount; i++) {
+      if (entries[i].status == status && entries[i].number == number && entries[i].control == control) {
+        return &entries[i];
+      }
+    }
+    Entry *entry = nullptr;
+    if (entryCount < CAPACITY) {
+      entry = &entries[entryCount++];
+    } else {
+      Entry *retired = nullptr;
+      for (uint8_t i = 0; i < entryCount && !entry; i++) {
+        Entry *candidate = &entries[i];
+        if (!candidate->pending) {
+          entry = candidate;
+        } else if (candidate->retired && (!retired || candidate->stamp - retired->stamp >= 0x80000000u)) {
+          retired = candidate;
+        }
+      }
+      if (!entry) {
+        entry = retired;
+      }
+      if (!entry) {
+        return nullptr;
+      }
+    }
+    entry->status    = status;
+    entry->control   = control;
+    entry->number    = number;
+    entry->pending   = false;
+    entry->sentValid = false;
+    return entry;
+  }
+
+  // the next value to send: the oldest, unless there's one with the running
+  // status and the oldest hasn't been passed over too often already
+  Entry *nextEntry() {
+    Entry *oldest  = nullptr;
+    Entry *running = nullptr;
+    for (uint8_t i = 0; i < entryCount; i++) {
+      Entry *entry = &entries[i];
+      if (!entry->pending) {
+        continue;
+      }
+      if (!oldest || entry->stamp - oldest->stamp >= 0x80000000u) {
+        oldest = entry;
+      }
+      if (entry->status == runningStatus && (!running || entry->stamp - running->stamp >= 0x80000000u)) {
+        running = entry;
+      }
+    }
+    if (running && oldest && oldest->skips < TRS_MIDI_MAX_SKIPS) {
+      return running;
+    }
+    return oldest;
+  }
+
+  // encode entry into message; returns its length (0: nothing to send)
+  uint8_t build(const Entry *entry, uint8_t *message) {
+    bool same      = entry->sentValid && entry->sentHighRes == entry->highRes;
+    uint8_t length = 0;
+
+    if (same && entry->sentValue == entry->value) {
+      return 0;
+    }
+    if (entry->status != runningStatus) {
+      message[length++] = entry->status;
+    }
+
+    uint8_t msb = (entry->value >> 7) & 0x7F;
+    switch (entry->control) {
+    case CONTROL_PITCH_BEND:
+      message[length++] = entry->value & 0x7F;
+      message[length++] = msb;
+      break;
+    case CONTROL_NRPN:
+      if (nrpnParameter[entry->status & 0x0F] != entry->number) {
+        message[length++] = 99;
+        message[length++] = entry->number >> 7;
+        message[length++] = 98;
+        message[length++] = entry->number & 0x7F;
+        same              = false; // another parameter's data entry was last
+      }
+      if (!same || ((entry->sentValue >> 7) & 0x7F) != msb) {
+        message[length++] = 6;
+        message[length++] = msb;
+      }
+      message[length++] = 38;
+      message[length++] = entry->value & 0x7F;
+      break;
+    case CONTROL_CC:
+      if (entry->highRes) {
+        if (!same || ((entry->sentValue >> 7) & 0x7F) != msb) {
+          message[length++] = entry->number;
+          message[length++] = msb;
+        }
+        message[length++] = entry->number + 32;
+        message[length++] = entry->value & 0x7F;
+      } else {
+        message[length++] = entry->number;
+        message[length++] = entry->value & 0x7F;
+      }
+      break;
+    }
+    return length;
+  }
+
+  uint16_t thruFree() const {
+    return TRS_MIDI_THRU_SIZE - 1 - (thruHead + TRS_MIDI_THRU_SIZE - thruTail) % TRS_MIDI_THRU_SIZE;
+  }
+
+  // room length bytes take in the FIFO, with their segment headers
+  static uint16_t thruNeeded(uint16_t length) {
+    return length + (length + TRS_MIDI_THRU_SEGMENT - 1) / TRS_MIDI_THRU_SEGMENT;
+  }
+
+  // queue bytes as segments; continues marks the last one as not the end of
+  // its message
+  void thruQueue(const uint8_t *bytes, uint16_t length, bool continues) {
+    while (length) {
+      uint8_t segment  = length < TRS_MIDI_THRU_SEGMENT ? length : TRS_MIDI_THRU_SEGMENT;
+      length          -= segment;
+      thruPush(segment | (continues || length ? 0x80 : 0));
+      for (uint8_t i = 0; i < segment; i++) {
+        thruPush(*bytes++);
+      }
+    }
+  }
+
+  void thruPush(uint8_t byte) {
+    thru[thruHead] = byte;
+    thruHead       = (thruHead + 1) % TRS_MIDI_THRU_SIZE;
+  }
+
+  uint8_t thruPop() {
+    uint8_t byte = thru[thruTail];
+    thruTail     = (thruTail + 1) % TRS_MIDI_THRU_SIZE;
+    return byte;
+  }
+
+  Entry entries[CAPACITY];
+  uint8_t entryCount = 0;
+  uint32_t nextStamp = 0;
+
+  // thru messages, stored as segments of up to TRS_MIDI_THRU_SEGMENT bytes,
+  // each behind a header byte: its length, plus 0x80 if the message goes on
+  // in the next segment
+  uint8_t thru[TRS_MIDI_THRU_SIZE];
+  uint16_t thruHead    = 0;
+  uint16_t thruTail    = 0;
+  uint8_t thruMessage  = 0;     // bytes left of the thru segment being sent
+  bool thruOpen        = false; // a sysex is partly queued
+  bool thruSkipping    = false; // a part was dropped: drop the rest of it
+  bool thruWireOpen    = false; // the message being sent isn't all queued yet
+  uint32_t droppedThru = 0;
+
+  uint8_t realtime[TRS_MIDI_REALTIME_SIZE]; // realtime thru bytes
+  uint8_t realtimeHead = 0;
+  uint8_t realtimeTail = 0;
+
+  uint32_t droppedUart    = 0; // bytes the UART didn't take
+  uint8_t mostOutstanding = 0; // modelled high-water mark of bytes in flight
+
+  uint8_t runningStatus = 0; // the last status byte on the wire (0: none)
+  int32_t credit        = 0; // us of link time available
+  uint32_t lastUs       = 0;
+
+  uint16_t nrpnParameter[16]; // selected on the wire, by channel
+};
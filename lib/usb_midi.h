@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hal.h"
+#include "latency.h"
+
+/*
+ * USB-MIDI 1.0 event packets: a header byte (cable number << 4 | code index
+ * number) followed by the MIDI message, zero-padded to 3 bytes.
+ *
+ * Fader output is built straight into packets and collected over a scan,
+ * then handed to the USB stack in one halUsbMidiWritePackets() call, which
+ * puts them straight into its TX FIFO and flushes once, so the stack has
+ * nothing to re-parse and a sweep fills whole transfers. It returns how many
+ * packets the FIFO took; only the rest count as lost.
+ *
+ * NRPNs only select their parameter (CCs 99 and 98) when it isn't the one
+ * already selected on their channel; after that, a value is just the data
+ * entry pair (CCs 6 and 38).
+ */
+
+#define USB_MIDI_PACKET_SIZE 4
+#define USB_MIDI_CABLE       0
+#define USB_MIDI_NO_NRPN     0xFFFF // no parameter known to be selected
+
+// how many of a packet's 3 MIDI bytes are used, by code index number
+static inline uint8_t usbMidiPacketLength(const uint8_t *packet) {
+  static const uint8_t lengths[16] = {0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1};
+  return lengths[packet[0] & 0x0F];
+}
+
+template <uint16_t CAPACITY>
+class UsbMidiPackets {
+  public:
+  UsbMidiPackets() {
+    invalidate();
+  }
+
+  // a channel voice message; data2 is ignored for program change and
+  // channel pressure. If the buffer is full, what's in it is sent first.
+  void addChannelMessage(uint8_t status, uint8_t data1, uint8_t data2) {
+    if (count == CAPACITY) {
+      send();
+    }
+    uint8_t *packet = packets[count++];
+    uint8_t cin     = status >> 4; // for channel voice messages, the CIN is the message type
+    packet[0]       = (USB_MIDI_CABLE << 4) | cin;
+    packet[1]       = status;
+    packet[2]       = data1;
+    packet[3]       = cin == 0xC || cin == 0xD ? 0 : data2;
+
+    // a (N)RPN select of our own (as a plain CC) changes what's selected
+    if (cin == 0xB && data1 >= 98 && data1 <= 101) {
+      nrpnParameter[status & 0x0F] = USB_MIDI_NO_NRPN;
+    }
+  }
+
+  // a 14-bit NRPN value (status: 0xB0 | channel)
+  void addNrpn(uint8_t status, uint16_t parameter, uint16_t value) {
+    uint16_t &selected = nrpnParameter[status & 0x0F];
+    if (selected != parameter) {
+      addChannelMessage(status, 99, parameter >> 7);
+      addChannelMessage(status, 98, parameter & 0x7F);
+      selected = parameter;
+    }
+    addChannelMessage(status, 6, value >> 7);
+    addChannelMessage(status, 38, value & 0x7F);
+  }
+
+  // a 14-bit pitch bend (status: 0xE0 | channel)
+  void addPitchBend(uint8_t status, uint16_t value) {
+    addChannelMessage(status, value & 0x7F, value >> 7);
+  }
+
+  // select every NRPN parameter again, next time it's sent
+  void invalidate() {
+    for (uint8_t channel = 0; channel < 16; channel++) {
+      nrpnParameter[channel] = USB_MIDI_NO_NRPN;
+    }
+  }
+
+  // submit everything collected so far
+  void send() {
+    if (count) {
+      LATENCY_RECORD(LATENCY_USB);
+      uint32_t accepted = halUsbMidiWritePackets(packets[0], count);
+      if (accepted < count) {
+        shortWrites++;
+        droppedPackets += count - accepted;
+        invalidate(); // a select may have been lost
+      }
+      count = 0;
+    }
+  }
+
+  uint16_t pending() const {
+    return count;
+  }
+
+  // sends the USB stack didn't take all of, and the packets it didn't take
+  uint32_t shortSends() const {
+    return shortWrites;
+  }
+  uint32_t dropped() const {
+    return droppedPackets;
+  }
+
+  private:
+  uint8_t packets[CAPACITY][USB_MIDI_PACKET_SIZE];
+  uint16_t count          = 0;
+  uint32_t shortWrites    = 0;
+  uint32_t droppedPackets = 0;
+  uint16_t nrpnParameter[16]; // selected, by channel
+};
@@ -3,61 +3,65 @@
  *
  */
 
-#include "pico/i2c_slave.h"
+#pragma once
+
+#include "lib/board.h"
 
 #define FIRMWARE_VERSION_MAJOR 3
 #define FIRMWARE_VERSION_MINOR 1
 #define FIRMWARE_VERSION_POINT 1
 
-#define FADER_COUNT            16
-
-#define MEMORY_MAP_LENGTH      86
-
-// define the board type here:
-// SIXTEEN_RX = 16rx
-// SIXTEEN_NX = 16nx
-// SIXTEEN_NEXT_DEV_BOARD = 16next dev board
-#define SIXTEEN_NX             1
-
-#ifdef SIXTEEN_NEXT_DEV_BOARD
-#define FIRST_MUX_PIN    18
-#define MUX_PIN_COUNT    4
-#define ADC_PIN          26
-#define INTERNAL_LED_PIN 22
-#define I2C_SDA_PIN      10
-#define I2C_SCL_PIN      11
-#define DEVICE_INDEX     5
-#elif SIXTEEN_RX
-#define FIRST_MUX_PIN    18
-#define MUX_PIN_COUNT    4
-#define ADC_PIN          26
-#define INTERNAL_LED_PIN 2
-#define I2C_SDA_PIN      10
-#define I2C_SCL_PIN      11
-#define DEVICE_INDEX     4
-#elif SIXTEEN_NX
-#define FIRST_MUX_PIN    18
-#define MUX_PIN_COUNT    4
-#define ADC_PIN          26
-#define INTERNAL_LED_PIN 2
-#define I2C_SDA_PIN      10
-#define I2C_SCL_PIN      11
-#define DEVICE_INDEX     5
-// #define INVERT_ADC 1// pots appear to be wired in reverse?
-#endif
+// shorthands for the board being built for (see lib/board.h)
+#define FADER_COUNT       Board::faderCount
+#define DEVICE_INDEX      Board::deviceIndex
+#define ADC_RESOLUTION    Board::adcResolution
+
+#define MEMORY_MAP_LENGTH 86
 
-#define ADC_RESOLUTION      12
+// ADC conversions averaged per fader, per scan: a power of two, 1-64. Scan
+// frames (and so the filters and outputs) are 14-bit whatever this is, but
+// only 16 or more gives a genuine 14 bits; 1 is the old single conversion.
+// Each conversion adds 2us to a fader's dwell.
+#define SCAN_OVERSAMPLE     16
+
+// Uncomment to time the fader filters on the processor at startup, and print
+// their cycles per update to stdio (see main.cpp). Host timings are no guide
+// to this: the M0+ has no FPU and no 32x32->64 multiply.
+// #define FILTER_CYCLE_PROBE 1
 
 // I2C Address for Faderbank. 0x34 unless you ABSOLUTELY know what you are doing.
 #define I2C_ADDRESS         0x34
 #define I2C_BAUDRATE        400000
-
-// define startup delay in milliseconds for i2c Leader devices
-// this gives follower devices time to boot up.
-#define BOOTDELAY           10000
+// as follower, writing this (instead of an input number) reads every input
+// at once
+#define I2C_READ_ALL        0x80
+// as leader, the bus can run at 1MHz (Fast-mode Plus) instead - if every
+// follower on it can keep up
+#ifndef I2C_LEADER_BAUDRATE
+#define I2C_LEADER_BAUDRATE I2C_BAUDRATE
+#endif
+// leader writes that take longer than this are abandoned, and the device
+// is left alone for I2C_BACKOFF_MIN_MS, doubling with each failure in a row
+// up to I2C_BACKOFF_MAX_MS
+#define I2C_WRITE_TIMEOUT_US 2000
+#define I2C_BACKOFF_MIN_MS   10
+#define I2C_BACKOFF_MAX_MS   1000
+// a device that fails this many writes in a row has gone; devices that
+// aren't there are probed for about every I2C_DISCOVERY_INTERVAL_MS
+#define I2C_MAX_FAILURES          4
+#define I2C_DISCOVERY_INTERVAL_MS 1000
 
 #define MIDI_BLINK_DURATION 5000 // us
 
+// calibration capture only sets the endpoints of faders that were moved
+// through at least this much (14-bit) of their travel
+#define CALIBRATION_MIN_TRAVEL 8192
+
+// config edits are committed to flash once they've settled; erasing flash
+// ready for the next commit waits until there's been no MIDI or fader
+// activity for this long, as it stalls everything while it runs.
+#define FLASH_PREPARE_IDLE_MS 5000
+
 // UART selection Pin mapping. You can move these for your design if you want to
 // Make sure all these values are consistent with your choice of midi_uart
 // The default is to use UART 1, but you are free to use UART 0 if you make
@@ -73,15 +77,34 @@
 #define MIDI_UART_RX_GPIO 5
 #endif
 
+// TRS MIDI runs at 31250 baud: 10 bits, so 320us, a byte. Fader output is
+// only written as fast as that (see lib/trs_midi.h), with up to
+// TRS_MIDI_BURST_BYTES allowed out at once after a quiet spell.
+#define TRS_MIDI_BYTE_US     320
+#define TRS_MIDI_BURST_BYTES 16
+
 #define MIDI_INPUT_BUFFER    64
+#define SYSEX_BUFFER_SIZE    128 // longest incoming sysex we keep (a config edit is 96)
 
-#define CONTROL_POLL_TIMEOUT 10 // ms
+// Faders that are moving (ie, whose filters are awake) are scanned every
+// frame; idle faders only every SCAN_BACKGROUND_DIVIDER frames, so at 1ms
+// and 10 an idle faderbank costs what a fixed 10ms scan did.
+#define SCAN_FRAME_PERIOD_US    1000
+#define SCAN_BACKGROUND_DIVIDER 10
+// how long a fader stays at the full rate after it was last awake or changed
+#define SCAN_ACTIVE_HOLD_MS     250
 
-/*
- * Functions appearing in 16next.cpp
- */
+// Uncomment to measure how long fader readings take to reach each output
+// (see lib/latency.h). Cheap enough to leave on.
+// #define LATENCY_INSTRUMENTATION 1
 
-void midi_read_task();
-void updateControls(bool force = false);
-static void i2c_slave_handler(i2c_inst_t *i2c, i2c_slave_event_t event);
-void processSysexBuffer();
+// Uncomment to run the fader scan and filtering on core1, leaving core0 to do
+// USB/UART/I2C output only. Changes are passed to core0 as FaderEvents.
+// #define CORE1_SCANNING 1
+// core1 runs from RAM, so it carries on while core0 writes to flash; the
+// build fails if it can reach anything in flash (tools/check_core1_ram.py).
+// As a fallback, uncomment to pause core1 for every flash write instead: the
+// scan then stops for each erase and page program, and the frames it misses
+// show up as scan jitter in the stats (sysex 0x19).
+// #define CORE1_FLASH_LOCKOUT 1
+#define FADER_EVENT_QUEUE_SIZE 64
@@ -0,0 +1,530 @@
+/**
+ * Fader filter benchmark
+ *
+ * Replays a corpus of synthetic scan frames (idle noise, slow sweeps, fast
+ * throws, hits on the 0/16383 edges) through each filter implementation and
+ * configuration, and prints one row of metrics per (configuration, trace).
+ * Like the firmware's, the frames are 14-bit oversampled sums (see
+ * fader_scan.h), and all LSBs below are 14-bit ones:
+ *
+ * - settle_ms: after the last movement, how long until the output stays
+ *   within --settle-lsb of the target (-1 if it never does)
+ * - spurious_changes: output changes once the fader has been still for 1s
+ * - ramp_lag_lsb / ramp_lag_ms / max_ramp_lag_lsb: how far the output trails
+ *   a sweep, while it is moving
+ * - final_error_lsb: output - target at the end of the trace
+ * - host_ns_per_update: the relative host cost of an update, per fader. Only
+ *   for comparing rows with each other; it says nothing about the M0+, which
+ *   has no FPU (FILTER_CYCLE_PROBE in main.h measures that)
+ *
+ * Traces are sampled at the scan rate of a moving fader (SCAN_FRAME_PERIOD_US).
+ *
+ * With --equivalence it checks the filters against each other instead (see
+ * checkEquivalence()), and exits non-zero if they disagree by more than they
+ * should; ctest runs it that way.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ResponsiveAnalogRead.hpp"
+#include "fader_scan.h"
+#include "filter_bank.h"
+#include "main.h"
+
+#define BENCH_CHANNELS   FADER_COUNT
+#define BENCH_WARMUP_MS  1000 // stillness before spurious changes are counted
+#define BENCH_MAX        ((1 << SCAN_FRAME_BITS) - 1)
+#define BENCH_SCALE      (1 << (SCAN_FRAME_BITS - ADC_RESOLUTION)) // frame LSBs per ADC LSB
+#define BENCH_FRAME_MS   ((float)SCAN_FRAME_PERIOD_US / 1000)
+
+/*
+ * Trace corpus
+ */
+
+struct Trace {
+  std::string name;
+  std::vector<uint16_t> raw; // what the ADC reads
+  std::vector<int> truth;    // where the fader actually is
+  float noiseSigma = 0;      // of the noise added to truth
+  size_t lastMove  = 0;      // first frame after the fader stops moving
+  size_t rampBegin = 0;      // frames over which the fader sweeps at a
+  size_t rampEnd   = 0;      // constant rate (rampEnd == 0: no sweep)
+};
+
+static size_t msToFrames(uint32_t ms) {
+  return ms * 1000 / SCAN_FRAME_PERIOD_US;
+}
+
+class TraceBuilder {
+  public:
+  TraceBuilder(const std::string &name, float noiseSigma, uint32_t seed) : rng(seed), noise(0, noiseSigma) {
+    trace.name       = name;
+    trace.noiseSigma = noiseSigma;
+  }
+
+  TraceBuilder &hold(int value, uint32_t ms) {
+    for (size_t i = 0; i < msToFrames(ms); i++) {
+      push(value);
+    }
+    return *this;
+  }
+
+  TraceBuilder &ramp(int from, int to, uint32_t ms, bool measureLag = false) {
+    size_t frames = msToFrames(ms);
+    if (measureLag) {
+      trace.rampBegin = trace.truth.size();
+      trace.rampEnd   = trace.rampBegin + frames;
+    }
+    for (size_t i = 0; i < frames; i++) {
+      push(from + (int)((int64_t)(to - from) * (i + 1) / frames));
+    }
+    trace.lastMove = trace.truth.size();
+    return *this;
+  }
+
+  Trace build() {
+    return trace;
+  }
+
+  private:
+  void push(int value) {
+    int raw = value + (int)lroundf(noise(rng));
+    trace.truth.push_back(value);
+    trace.raw.push_back(raw < 0 ? 0 : raw > BENCH_MAX ? BENCH_MAX : raw);
+  }
+
+  Trace trace;
+  std::mt19937 rng;
+  std::normal_distribution<float> noise;
+};
+
+static std::vector<Trace> buildCorpus() {
+  std::vector<Trace> corpus;
+  // noise per conversion, in ADC LSBs; oversampling averages it down
+  const float noiseLevels[] = {1, 3, 6};
+
+  for (float adcSigma : noiseLevels) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_n%g", adcSigma);
+    std::string n = suffix;
+    float sigma   = adcSigma * BENCH_SCALE / sqrtf(SCAN_OVERSAMPLE);
+
+    corpus.push_back(TraceBuilder("idle_mid" + n, sigma, 1).hold(8192, 5000).build());
+    corpus.push_back(TraceBuilder("idle_zero" + n, sigma, 2).hold(0, 5000).build());
+    corpus.push_back(TraceBuilder("idle_full" + n, sigma, 3).hold(BENCH_MAX, 5000).build());
+    corpus.push_back(
+        TraceBuilder("slow_sweep" + n, sigma, 4).hold(0, 500).ramp(0, BENCH_MAX, 4000, true).hold(BENCH_MAX, 3000).build());
+    corpus.push_back(
+        TraceBuilder("slow_nudge" + n, sigma, 5).hold(8000, 500).ramp(8000, 8160, 2000, true).hold(8160, 3000).build());
+    corpus.push_back(TraceBuilder("fast_throw_up" + n, sigma, 6).hold(1600, 500).ramp(1600, 14800, 30).hold(14800, 3000).build());
+    corpus.push_back(TraceBuilder("fast_throw_down" + n, sigma, 7).hold(14800, 500).ramp(14800, 1600, 30).hold(1600, 3000).build());
+    corpus.push_back(TraceBuilder("edge_hit_zero" + n, sigma, 8).hold(8192, 500).ramp(8192, 0, 50).hold(0, 3000).build());
+    corpus.push_back(
+        TraceBuilder("edge_hit_full" + n, sigma, 9).hold(8192, 500).ramp(8192, BENCH_MAX, 50).hold(BENCH_MAX, 3000).build());
+  }
+
+  return corpus;
+}
+
+/*
+ * Filters under test. Each runs BENCH_CHANNELS channels, so that the
+ * per-fader cost is comparable. Channel 0 gets the trace itself and is the
+ * one measured; the others get it at different offsets, so they are not all
+ * in the same state.
+ */
+
+struct FilterConfig {
+  float snapMultiplier;
+  float activityThreshold;
+};
+
+class FloatFilters {
+  public:
+  static const char *name() {
+    return "float";
+  }
+  void begin(const FilterConfig &config) {
+    for (auto &f : filters) {
+      f.setAnalogResolution(BENCH_MAX + 1);
+      f.begin(0, true, config.snapMultiplier);
+      f.setActivityThreshold(config.activityThreshold);
+    }
+  }
+  void update(const uint16_t *frame, int *values) {
+    for (int i = 0; i < BENCH_CHANNELS; i++) {
+      filters[i].update(frame[i]);
+      values[i] = filters[i].getValue();
+    }
+  }
+
+  private:
+  ResponsiveAnalogRead filters[BENCH_CHANNELS];
+};
+
+class FixedFilters {
+  public:
+  static const char *name() {
+    return "fixed";
+  }
+  void begin(const FilterConfig &config) {
+    for (auto &f : filters) {
+      f.setAnalogResolution(BENCH_MAX + 1);
+      f.begin(0, true, config.snapMultiplier);
+      f.setActivityThreshold(config.activityThreshold);
+    }
+  }
+  void update(const uint16_t *frame, int *values) {
+    for (int i = 0; i < BENCH_CHANNELS; i++) {
+      filters[i].update(frame[i]);
+      values[i] = filters[i].getValue();
+    }
+  }
+
+  private:
+  ResponsiveAnalogReadFixed filters[BENCH_CHANNELS];
+};
+
+class BankFilters {
+  public:
+  static const char *name() {
+    return "bank";
+  }
+  void begin(const FilterConfig &config) {
+    bank.setAnalogResolution(BENCH_MAX + 1);
+    bank.begin(true, config.snapMultiplier);
+    bank.setActivityThreshold(config.activityThreshold);
+  }
+  void update(const uint16_t *frame, int *values) {
+    bank.update(frame);
+    for (int i = 0; i < BENCH_CHANNELS; i++) {
+      values[i] = bank.getValue(i);
+    }
+  }
+
+  private:
+  FilterBank<BENCH_CHANNELS> bank;
+};
+
+/*
+ * Metrics
+ */
+
+struct Metrics {
+  float settleMs;
+  uint32_t spuriousChanges;
+  float rampLagLsb;
+  float rampLagMs;
+  int maxRampLagLsb;
+  int finalErrorLsb;
+  float hostNsPerUpdate;
+};
+
+struct BenchOptions {
+  int settleLsb       = 8 * BENCH_SCALE;
+  uint32_t iterations = 20;
+  bool json           = false;
+};
+
+static Metrics measure(const Trace &trace, const std::vector<int> &out, const BenchOptions &options) {
+  Metrics m = {};
+  size_t n  = out.size();
+  int final = trace.truth.back();
+
+  // settle: the first frame from which the output stays within settleLsb
+  size_t settledAt = n;
+  for (size_t i = n; i > trace.lastMove; i--) {
+    if (abs(out[i - 1] - final) > options.settleLsb) {
+      break;
+    }
+    settledAt = i - 1;
+  }
+  m.settleMs = settledAt == n ? -1 : (float)(settledAt - trace.lastMove) * BENCH_FRAME_MS;
+
+  size_t idleFrom = trace.lastMove + msToFrames(BENCH_WARMUP_MS);
+  for (size_t i = idleFrom < 1 ? 1 : idleFrom; i < n; i++) {
+    if (out[i] != out[i - 1]) {
+      m.spuriousChanges++;
+    }
+  }
+
+  if (trace.rampEnd > trace.rampBegin) {
+    int direction = trace.truth[trace.rampEnd - 1] >= trace.truth[trace.rampBegin] ? 1 : -1;
+    int64_t total = 0;
+    for (size_t i = trace.rampBegin; i < trace.rampEnd; i++) {
+      int lag = (trace.truth[i] - out[i]) * direction;
+      total += lag;
+      if (lag > m.maxRampLagLsb) {
+        m.maxRampLagLsb = lag;
+      }
+    }
+    size_t frames  = trace.rampEnd - trace.rampBegin;
+    float slope    = fabsf((float)(trace.truth[trace.rampEnd - 1] - trace.truth[trace.rampBegin])) / (frames - 1);
+    m.rampLagLsb   = (float)total / frames;
+    m.rampLagMs    = slope > 0 ? m.rampLagLsb / slope * BENCH_FRAME_MS : 0;
+  }
+
+  m.finalErrorLsb = out.back() - final;
+  return m;
+}
+
+static volatile int benchSink;
+
+// replay a trace through a fresh set of filters, filling out with channel 0's
+// output. Returns a checksum of every channel's output, so that none of the
+// work can be optimised away.
+template <class Filters>
+static int replay(const FilterConfig &config, const Trace &trace, std::vector<int> *out = nullptr) {
+  Filters filters;
+  uint16_t frame[BENCH_CHANNELS];
+  int values[BENCH_CHANNELS];
+  size_t n = trace.raw.size();
+  int sum  = 0;
+
+  filters.begin(config);
+  for (size_t i = 0; i < n; i++) {
+    for (size_t c = 0; c < BENCH_CHANNELS; c++) {
+      frame[c] = trace.raw[(i + c * (n / BENCH_CHANNELS)) % n];
+    }
+    filters.update(frame, values);
+    for (int value : values) {
+      sum += value;
+    }
+    if (out) {
+      (*out)[i] = values[0];
+    }
+  }
+  return sum;
+}
+
+template <class Filters>
+static Metrics run(const FilterConfig &config, const Trace &trace, const BenchOptions &options) {
+  std::vector<int> out(trace.raw.size());
+  replay<Filters>(config, trace, &out);
+  Metrics m  = measure(trace, out, options);
+
+  int sink   = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t iteration = 0; iteration < options.iterations; iteration++) {
+    // read the config through a volatile, so that the compiler can't hoist
+    // the (otherwise identical) replays out of the loop
+    volatile FilterConfig opaque = config;
+    sink += replay<Filters>({opaque.snapMultiplier, opaque.activityThreshold}, trace);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  benchSink    = sink;
+
+  double ns     = std::chrono::duration<double, std::nano>(elapsed).count();
+  m.hostNsPerUpdate = ns / ((double)options.iterations * trace.raw.size() * BENCH_CHANNELS);
+  return m;
+}
+
+/*
+ * Output
+ */
+
+static bool firstRow = true;
+
+static void printRow(const BenchOptions &options, const char *filter, const FilterConfig &config, const Trace &trace,
+                     const Metrics &m) {
+  if (options.json) {
+    printf("%s\n  {\"filter\": \"%s\", \"snap\": %g, \"threshold\": %g, \"trace\": \"%s\", \"settle_ms\": %g, "
+           "\"spurious_changes\": %u, \"ramp_lag_lsb\": %.2f, \"ramp_lag_ms\": %.1f, \"max_ramp_lag_lsb\": %d, "
+           "\"final_error_lsb\": %d, \"host_ns_per_update\": %.2f}",
+           firstRow ? "" : ",", filter, config.snapMultiplier, config.activityThreshold, trace.name.c_str(), m.settleMs,
+           m.spuriousChanges, m.rampLagLsb, m.rampLagMs, m.maxRampLagLsb, m.finalErrorLsb, m.hostNsPerUpdate);
+  } else {
+    printf("%s,%g,%g,%s,%g,%u,%.2f,%.1f,%d,%d,%.2f\n", filter, config.snapMultiplier, config.activityThreshold,
+           trace.name.c_str(), m.settleMs, m.spuriousChanges, m.rampLagLsb, m.rampLagMs, m.maxRampLagLsb,
+           m.finalErrorLsb, m.hostNsPerUpdate);
+  }
+  firstRow = false;
+}
+
+template <class Filters>
+static void benchFilter(const BenchOptions &options, const std::vector<FilterConfig> &configs,
+                        const std::vector<Trace> &corpus) {
+  for (const FilterConfig &config : configs) {
+    for (const Trace &trace : corpus) {
+      printRow(options, Filters::name(), config, trace, run<Filters>(config, trace, options));
+    }
+  }
+}
+
+/*
+ * Equivalence
+ *
+ * Every trace goes through the float filter and the Q16.16 one, with and
+ * without sleep, and their outputs are compared sample by sample:
+ *
+ * - without sleep they must agree within EQUIVALENCE_MAX_LSB
+ * - with sleep, the two can disagree for a sample over whether errorEMA is
+ *   under the activity threshold, so one parks while the other moves on.
+ *   Until the next wake they can then sit up to twice the threshold apart,
+ *   plus however far the noise had pushed the one that parked: bounded here
+ *   as 2 * threshold + 3 sigma.
+ *
+ * FilterBank is the Q16.16 filter restructured, so it must match
+ * ResponsiveAnalogReadFixed exactly.
+ */
+
+#define EQUIVALENCE_MAX_LSB 1
+
+struct Equivalence {
+  int maxDiff;     // float vs fixed
+  int maxBankDiff; // bank vs fixed
+};
+
+static Equivalence compareFilters(const FilterConfig &config, bool sleep, const Trace &trace) {
+  ResponsiveAnalogRead floatFilter;
+  ResponsiveAnalogReadFixed fixedFilter;
+  FilterBank<BENCH_CHANNELS> bank;
+  uint16_t frame[BENCH_CHANNELS];
+  Equivalence e = {};
+
+  floatFilter.setAnalogResolution(BENCH_MAX + 1);
+  fixedFilter.setAnalogResolution(BENCH_MAX + 1);
+  bank.setAnalogResolution(BENCH_MAX + 1);
+  floatFilter.begin(0, sleep, config.snapMultiplier);
+  floatFilter.setActivityThreshold(config.activityThreshold);
+  fixedFilter.begin(0, sleep, config.snapMultiplier);
+  fixedFilter.setActivityThreshold(config.activityThreshold);
+  bank.begin(sleep, config.snapMultiplier);
+  bank.setActivityThreshold(config.activityThreshold);
+
+  for (uint16_t raw : trace.raw) {
+    floatFilter.update(raw);
+    fixedFilter.update(raw);
+    for (uint16_t &sample : frame) {
+      sample = raw;
+    }
+    bank.update(frame);
+
+    int diff     = abs(floatFilter.getValue() - fixedFilter.getValue());
+    int bankDiff = abs(bank.getValue(0) - fixedFilter.getValue());
+    if (diff > e.maxDiff) {
+      e.maxDiff = diff;
+    }
+    if (bankDiff > e.maxBankDiff) {
+      e.maxBankDiff = bankDiff;
+    }
+  }
+  return e;
+}
+
+// prints the largest differences per configuration; returns false if any
+// is out of bounds
+static bool checkEquivalence(const std::vector<FilterConfig> &configs, const std::vector<Trace> &corpus) {
+  bool ok = true;
+  printf("snap,threshold,sleep,max_diff_lsb,bound_lsb,max_bank_diff_lsb\n");
+  for (const FilterConfig &config : configs) {
+    for (bool sleep : {false, true}) {
+      Equivalence worst = {};
+      int worstBound    = 0;
+      for (const Trace &trace : corpus) {
+        int bound     = sleep ? 2 * (int)config.activityThreshold + (int)ceilf(3 * trace.noiseSigma)
+                              : EQUIVALENCE_MAX_LSB;
+        Equivalence e = compareFilters(config, sleep, trace);
+        if (e.maxDiff > bound || e.maxBankDiff) {
+          fprintf(stderr, "FAIL: snap %g threshold %g sleep %d trace %s: float/fixed %d LSB (bound %d), "
+                          "bank/fixed %d LSB (bound 0)\n",
+                  config.snapMultiplier, config.activityThreshold, sleep, trace.name.c_str(), e.maxDiff, bound,
+                  e.maxBankDiff);
+          ok = false;
+        }
+        if (e.maxDiff > worst.maxDiff) {
+          worst.maxDiff = e.maxDiff;
+          worstBound    = bound;
+        }
+        if (e.maxBankDiff > worst.maxBankDiff) {
+          worst.maxBankDiff = e.maxBankDiff;
+        }
+      }
+      printf("%g,%g,%d,%d,%d,%d\n", config.snapMultiplier, config.activityThreshold, sleep, worst.maxDiff,
+             worstBound, worst.maxBankDiff);
+    }
+  }
+  return ok;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: 16next_filter_bench [options]\n"
+          "  --json            JSON output (default CSV)\n"
+          "  --settle-lsb N    settled means within N LSB of the target (default 32)\n"
+          "  --iterations N    timing passes over each trace (default 20)\n"
+          "  --filter NAME     only float, fixed or bank\n"
+          "  --equivalence     check the filters agree, instead of benchmarking them\n");
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options;
+  const char *only = nullptr;
+  bool equivalence = false;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg   = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+    if (!strcmp(arg, "--json")) {
+      options.json = true;
+    } else if (!strcmp(arg, "--settle-lsb") && value) {
+      options.settleLsb = atoi(argv[++i]);
+    } else if (!strcmp(arg, "--iterations") && value) {
+      options.iterations = strtoul(argv[++i], nullptr, 0);
+    } else if (!strcmp(arg, "--filter") && value) {
+      only = argv[++i];
+    } else if (!strcmp(arg, "--equivalence")) {
+      equivalence = true;
+    } else {
+      usage();
+      return !strcmp(arg, "--help") ? 0 : 1;
+    }
+  }
+
+  // the firmware's settings (snap .05 / 4, threshold 16 * 4: the 12-bit
+  // ones, scaled to 14-bit frames) and the space around them
+  std::vector<FilterConfig> configs;
+  const float snaps[]      = {0.01f, 0.05f, 0.1f};
+  const float thresholds[] = {8, 16, 32};
+  for (float snap : snaps) {
+    for (float threshold : thresholds) {
+      configs.push_back({snap / BENCH_SCALE, threshold * BENCH_SCALE});
+    }
+  }
+
+  std::vector<Trace> corpus = buildCorpus();
+
+  if (equivalence) {
+    return checkEquivalence(configs, corpus) ? 0 : 1;
+  }
+
+  if (options.json) {
+    printf("[");
+  } else {
+    printf("filter,snap,threshold,trace,settle_ms,spurious_changes,ramp_lag_lsb,ramp_lag_ms,max_ramp_lag_lsb,"
+           "final_error_lsb,host_ns_per_update\n");
+  }
+
+  if (!only || !strcmp(only, FloatFilters::name())) {
+    benchFilter<FloatFilters>(options, configs, corpus);
+  }
+  if (!only || !strcmp(only, FixedFilters::name())) {
+    benchFilter<FixedFilters>(options, configs, corpus);
+  }
+  if (!only || !strcmp(only, BankFilters::name())) {
+    benchFilter<BankFilters>(options, configs, corpus);
+  }
+
+  if (options.json) {
+    printf("\n]\n");
+  }
+  return 0;
+}
@@ -0,0 +1,735 @@
+/*
+ * Host implementation of hal.h, for the simulator. See hal_host.h.
+ */
+
+#include "hal_host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <deque>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "fader_scan.h"
+#include "faderbank.h"
+#include "hal.h"
+#include "main.h"
+#include "usb_midi.h"
+
+#ifdef CORE1_SCANNING
+#error "the simulator is single-threaded; build it without CORE1_SCANNING"
+#endif
+
+static uint64_t nowUs = 0;
+static SimStats stats;
+
+static void serviceUsb(uint64_t untilUs);
+static void serviceI2cReads();
+
+/*
+ * Fader traces
+ */
+
+struct TracePoint {
+  uint32_t timeMs;
+  uint16_t values[FADER_COUNT];
+};
+
+static std::vector<TracePoint> trace;
+static std::mt19937 noiseRng;
+static uint16_t noiseLsb = 0;
+
+static bool loadTrace(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "sim: can't open trace %s\n", path);
+    return false;
+  }
+
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    char *p = line;
+    char *end;
+    TracePoint point;
+
+    point.timeMs = strtoul(p, &end, 10);
+    if (end == p) {
+      continue; // header or blank line
+    }
+    p = end;
+    for (int i = 0; i < FADER_COUNT; i++) {
+      while (*p == ',' || *p == ' ') {
+        p++;
+      }
+      long value = strtol(p, &end, 10);
+      if (end != p) {
+        p = end;
+      }
+      // a short row repeats its last value
+      point.values[i] = value < 0 ? 0 : value > 4095 ? 4095 : value;
+    }
+    trace.push_back(point);
+  }
+
+  fclose(f);
+  return true;
+}
+
+// the raw 12-bit reading of a fader at the current time
+static uint16_t sampleFader(uint8_t fader) {
+  int value = 0;
+
+  if (!trace.empty()) {
+    uint32_t timeMs = nowUs / 1000;
+    size_t next     = 0;
+    while (next < trace.size() && trace[next].timeMs <= timeMs) {
+      next++;
+    }
+
+    if (next == 0) {
+      value = trace.front().values[fader];
+    } else if (next == trace.size()) {
+      value = trace.back().values[fader];
+    } else {
+      const TracePoint &a = trace[next - 1];
+      const TracePoint &b = trace[next];
+      int64_t span        = (int64_t)(b.timeMs - a.timeMs) * 1000;
+      int64_t into        = (int64_t)nowUs - (int64_t)a.timeMs * 1000;
+      value = a.values[fader] + (int)(((int64_t)b.values[fader] - a.values[fader]) * into / span);
+    }
+  }
+
+  if (noiseLsb) {
+    std::uniform_int_distribution<int> noise(-noiseLsb, noiseLsb);
+    value += noise(noiseRng);
+  }
+
+  return value < 0 ? 0 : value > 4095 ? 4095 : value;
+}
+
+/*
+ * Fader scan: the sequencer is stepped from simAdvance(), at the times the
+ * RP2040 alarm would fire. Conversions sample whichever fader the mux is
+ * pointing at.
+ */
+
+class HostScanHardware : public ScanHardware {
+  public:
+  void init() {
+    for (int i = 0; i < FADER_COUNT; i++) {
+      faderForMux[Board::muxOrder[i]] = i;
+    }
+  }
+
+  void selectMux(uint8_t address) override {
+    mux = address;
+  }
+
+  void startConversions(uint16_t *samples, uint8_t count) override {
+    // each conversion gets its own noise, as on the real ADC
+    for (uint8_t i = 0; i < count; i++) {
+      samples[i] = sampleFader(faderForMux[mux]);
+    }
+  }
+
+  void stopConversions() override {
+  }
+
+  private:
+  uint8_t faderForMux[16] = {};
+  uint8_t mux             = 0;
+};
+
+static HostScanHardware scanHardware;
+static FaderScanSequencer<Board, SCAN_OVERSAMPLE> scanSequencer;
+static bool scanRunning   = false;
+static uint64_t nextScanUs = 0;
+
+void faderScanInit(uint32_t framePeriodUs, uint8_t backgroundDivider) {
+  scanHardware.init();
+  scanSequencer.begin(framePeriodUs, backgroundDivider);
+  scanRunning = true;
+  nextScanUs  = nowUs + SCAN_MIN_GAP_US;
+}
+
+bool faderScanTakeFrame(uint16_t *frame, uint32_t *timestampUs, uint16_t *sampledMask) {
+  return scanSequencer.takeFrame(frame, timestampUs, sampledMask);
+}
+
+void faderScanSetActive(uint16_t mask) {
+  scanSequencer.setActive(mask);
+}
+
+uint32_t faderScanDwellCount(uint8_t fader) {
+  return scanSequencer.dwellCount(fader);
+}
+
+/*
+ * time
+ */
+
+void simAdvance(uint32_t us) {
+  uint64_t target = nowUs + us;
+
+  while (scanRunning && nextScanUs <= target) {
+    serviceUsb(nextScanUs);
+    nowUs          = nextScanUs;
+    uint32_t delay = scanSequencer.step(scanHardware, (uint32_t)nowUs);
+    nextScanUs     = nowUs + delay;
+  }
+  serviceUsb(target);
+
+  nowUs = target;
+  serviceI2cReads();
+}
+
+uint64_t simNowUs() {
+  return nowUs;
+}
+
+uint32_t halMicros() {
+  return (uint32_t)nowUs;
+}
+
+void halSleepUs(uint32_t us) {
+  simAdvance(us);
+}
+
+/*
+ * LED
+ */
+
+static bool ledOn = false;
+
+void halLedInit() {
+  ledOn = false;
+}
+
+void halLedSet(bool on) {
+  ledOn = on;
+}
+
+/*
+ * Flash: a RAM image with NOR semantics - erase sets bytes to 0xFF, and
+ * programming can only clear bits.
+ */
+
+static uint8_t flashImage[HAL_STORAGE_SIZE];
+static const char *flashPath = nullptr;
+static uint32_t flashFailPrograms;
+static int32_t flashTearAt = -1;
+
+void halFlashRead(uint32_t offset, uint8_t *buf, uint32_t length) {
+  memcpy(buf, flashImage + offset, length);
+}
+
+void halFlashErase(uint32_t offset, uint32_t length) {
+  if (offset % HAL_FLASH_SECTOR_SIZE || length % HAL_FLASH_SECTOR_SIZE || offset + length > HAL_STORAGE_SIZE) {
+    fprintf(stderr, "sim: bad flash erase at %u, length %u\n", offset, length);
+    abort();
+  }
+  memset(flashImage + offset, 0xFF, length);
+  stats.flashErases++;
+}
+
+void halFlashProgram(uint32_t offset, const uint8_t *buf, uint32_t length) {
+  if (offset % HAL_FLASH_PAGE_SIZE || length % HAL_FLASH_PAGE_SIZE || offset + length > HAL_STORAGE_SIZE) {
+    fprintf(stderr, "sim: bad flash program at %u, length %u\n", offset, length);
+    abort();
+  }
+  stats.flashPrograms++;
+  if (flashFailPrograms) {
+    flashFailPrograms--;
+    stats.flashProgramsFailed++;
+    return;
+  }
+  if (flashTearAt >= 0) {
+    if ((uint32_t)flashTearAt < length) {
+      length = flashTearAt;
+    }
+    flashTearAt = -1;
+  }
+  for (uint32_t i = 0; i < length; i++) {
+    flashImage[offset + i] &= buf[i];
+  }
+}
+
+void simFlashFailPrograms(uint32_t count) {
+  flashFailPrograms = count;
+}
+
+void simFlashTearProgram(uint32_t bytes) {
+  flashTearAt = bytes;
+}
+
+/*
+ * Captured output
+ */
+
+static FILE *usbOut = nullptr;
+static FILE *trsOut = nullptr;
+static FILE *i2cOut = nullptr;
+
+static void captureBytes(FILE *f, const char *tag, const uint8_t *buf, uint32_t length) {
+  if (!f) {
+    return;
+  }
+  fprintf(f, "%llu %s", (unsigned long long)nowUs, tag);
+  for (uint32_t i = 0; i < length; i++) {
+    fprintf(f, " %02X", buf[i]);
+  }
+  fputc('\n', f);
+}
+
+/*
+ * I2C
+ */
+
+// addresses that ACK, and when they're on the bus: [from, until)
+struct I2cResponder {
+  uint64_t fromUs;
+  uint64_t untilUs;
+};
+static std::map<uint8_t, I2cResponder> i2cResponders;
+static std::set<uint8_t> i2cHung;
+static uint32_t i2cBaudrate = 400000;
+
+// the write in flight, if any: when it ends, and how
+static bool i2cActive     = false;
+static uint64_t i2cDoneUs = 0;
+static int i2cResult      = 0;
+
+void simI2cAddResponder(uint8_t address, uint32_t fromMs, uint32_t untilMs) {
+  i2cResponders[address] = {(uint64_t)fromMs * 1000, untilMs ? (uint64_t)untilMs * 1000 : UINT64_MAX};
+}
+
+static bool i2cResponds(uint8_t address) {
+  auto responder = i2cResponders.find(address);
+  return responder != i2cResponders.end() && nowUs >= responder->second.fromUs &&
+         nowUs < responder->second.untilUs;
+}
+
+void simI2cAddHung(uint8_t address) {
+  i2cHung.insert(address);
+}
+
+void halI2cInitLeader(uint32_t baudrate) {
+  i2cBaudrate = baudrate;
+  i2cActive   = false;
+}
+
+void halI2cInitFollower(uint8_t address, uint32_t baudrate) {
+}
+
+bool halI2cWriteStart(uint8_t address, const uint8_t *data, size_t length) {
+  if (i2cActive || length == 0 || length > HAL_I2C_MAX_WRITE) {
+    return false;
+  }
+  char tag[16];
+  snprintf(tag, sizeof(tag), "I2C %02X", address);
+  captureBytes(i2cOut, tag, data, length);
+  stats.i2cWrites++;
+
+  // 9 bits a byte (8 and the ACK), plus START and STOP. A NAK ends it after
+  // the address; a hung device holds SCL low and it never ends at all.
+  uint32_t bits;
+  if (i2cHung.count(address)) {
+    bits      = 0;
+    i2cResult = -1;
+    i2cDoneUs = UINT64_MAX;
+  } else if (!i2cResponds(address)) {
+    bits      = 9 + 2;
+    i2cResult = -1;
+    stats.i2cNaks++;
+  } else {
+    bits      = 9 * (1 + length) + 2;
+    i2cResult = length;
+  }
+  if (bits) {
+    i2cDoneUs = nowUs + ((uint64_t)bits * 1000000 + i2cBaudrate - 1) / i2cBaudrate;
+  }
+  i2cActive = true;
+  return true;
+}
+
+int halI2cWritePoll() {
+  if (!i2cActive) {
+    return 0;
+  }
+  if (nowUs < i2cDoneUs) {
+    return HAL_I2C_BUSY;
+  }
+  i2cActive = false;
+  return i2cResult;
+}
+
+void halI2cWriteAbort() {
+  i2cActive = false;
+  stats.i2cAborts++;
+}
+
+uint8_t simI2cFollowerRead(uint8_t command, uint8_t *buf, uint8_t length) {
+  i2cFollowerReceive(command);
+  i2cFollowerFinish(); // the repeated start
+
+  // a 16-byte TX FIFO's worth at a time, as the RP2040 would ask for it
+  uint8_t count = 0;
+  while (count < length) {
+    uint8_t fifo[16];
+    uint8_t got = i2cFollowerRequest(fifo, sizeof(fifo));
+    for (uint8_t i = 0; i < got && count < length; i++) {
+      buf[count++] = fifo[i];
+    }
+  }
+  i2cFollowerFinish();
+  return count;
+}
+
+// a leader reading every input at once, every i2cReadAllUs
+static uint32_t i2cReadAllUs     = 0;
+static uint64_t nextI2cReadAllUs = 0;
+
+static void serviceI2cReads() {
+  if (!i2cReadAllUs || nowUs < nextI2cReadAllUs) {
+    return;
+  }
+  nextI2cReadAllUs = nowUs + i2cReadAllUs;
+
+  uint8_t values[2 * FADER_COUNT];
+  simI2cFollowerRead(I2C_READ_ALL, values, sizeof(values));
+  captureBytes(i2cOut, "I2C READ", values, sizeof(values));
+  stats.i2cReads++;
+}
+
+/*
+ * USB MIDI: each line of the input script arrives as one chunk at its time.
+ */
+
+struct UsbInput {
+  uint64_t timeUs;
+  std::vector<uint8_t> bytes;
+};
+
+static std::deque<UsbInput> usbIn;
+
+static bool loadUsbInput(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "sim: can't open USB input %s\n", path);
+    return false;
+  }
+
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    char *p = line;
+    char *end;
+    UsbInput input;
+
+    if (*p == '#') {
+      continue;
+    }
+    input.timeUs = strtoull(p, &end, 10) * 1000;
+    if (end == p) {
+      continue;
+    }
+    p = end;
+    while (true) {
+      unsigned long byte = strtoul(p, &end, 16);
+      if (end == p) {
+        break;
+      }
+      input.bytes.push_back(byte);
+      p = end;
+    }
+    if (!input.bytes.empty()) {
+      usbIn.push_back(input);
+    }
+  }
+
+  fclose(f);
+  return true;
+}
+
+void halUsbInit() {
+}
+
+void halUsbTask() {
+}
+
+bool halUsbMidiAvailable() {
+  return !usbIn.empty() && usbIn.front().timeUs <= nowUs;
+}
+
+uint32_t halUsbMidiRead(uint8_t *buf, uint32_t maxLength) {
+  if (!halUsbMidiAvailable()) {
+    return 0;
+  }
+
+  std::vector<uint8_t> &bytes = usbIn.front().bytes;
+  uint32_t length             = bytes.size() < maxLength ? bytes.size() : maxLength;
+  memcpy(buf, bytes.data(), length);
+  bytes.erase(bytes.begin(), bytes.begin() + length);
+  if (bytes.empty()) {
+    usbIn.pop_front();
+  }
+  return length;
+}
+
+/*
+ * USB MIDI output, modelled on TinyUSB: writes put 4-byte event packets in
+ * the TX FIFO and then flush it. A flush starts a transfer of up to one
+ * endpoint's worth of packets if the IN endpoint is idle; the host collects
+ * it usbTransferUs later, and anything left in the FIFO then goes in the
+ * next transfer. Full FIFO: the write stops short.
+ */
+
+#define SIM_USB_FIFO_PACKETS (128 / USB_MIDI_PACKET_SIZE) // CFG_TUD_MIDI_TX_BUFSIZE at full speed
+#define SIM_USB_EP_PACKETS   (64 / USB_MIDI_PACKET_SIZE)  // 64-byte bulk endpoint
+
+static uint32_t usbTransferUs  = 100;
+static uint32_t usbFifoPackets = 0;
+static bool usbEndpointBusy    = false;
+static uint64_t usbTransferDoneUs;
+
+// a stream write's packet in progress (like TinyUSB's midid_stream_t)
+static uint8_t streamIndex = 0, streamTotal = 0;
+static bool streamInSysex  = false;
+
+static void usbFlush(uint64_t atUs) {
+  if (usbEndpointBusy || !usbFifoPackets) {
+    return;
+  }
+  uint32_t packets = usbFifoPackets < SIM_USB_EP_PACKETS ? usbFifoPackets : SIM_USB_EP_PACKETS;
+  usbFifoPackets -= packets;
+  stats.usbTransfers++;
+  stats.usbPacketsOut += packets;
+  usbEndpointBusy   = true;
+  usbTransferDoneUs = atUs + usbTransferUs;
+}
+
+// complete any transfers the host has collected by now, starting the next
+static void serviceUsb(uint64_t untilUs) {
+  while (usbEndpointBusy && usbTransferDoneUs <= untilUs) {
+    usbEndpointBusy = false;
+    usbFlush(usbTransferDoneUs);
+  }
+}
+
+static bool usbFifoPush() {
+  if (usbFifoPackets == SIM_USB_FIFO_PACKETS) {
+    stats.usbPacketsDropped++;
+    return false;
+  }
+  usbFifoPackets++;
+  return true;
+}
+
+uint32_t halUsbMidiWrite(const uint8_t *buf, uint32_t length) {
+  captureBytes(usbOut, "USB", buf, length);
+
+  // split the stream into packets, as tud_midi_stream_write() does
+  uint32_t i = 0;
+  for (; i < length; i++) {
+    uint8_t byte = buf[i];
+    if (streamIndex == 0) {
+      if (byte == 0xF0) {
+        streamInSysex = true;
+        streamTotal   = 3;
+      } else if (byte >= 0xF8 || byte == 0xF6 || (byte == 0xF7 && !streamInSysex)) {
+        streamTotal = 1;
+      } else if (byte >= 0xF0) {
+        streamTotal = byte == 0xF2 ? 3 : byte == 0xF7 ? 1 : 2;
+      } else if (byte >= 0x80) {
+        streamTotal = (byte & 0xF0) == 0xC0 || (byte & 0xF0) == 0xD0 ? 2 : 3;
+      } else if (streamInSysex) {
+        streamTotal = 3;
+      } else {
+        continue; // no running status
+      }
+    }
+    streamIndex++;
+    if (byte == 0xF7) {
+      streamInSysex = false;
+      streamTotal   = streamIndex;
+    }
+    if (streamIndex == streamTotal) {
+      streamIndex = 0;
+      if (!usbFifoPush()) {
+        break;
+      }
+    }
+  }
+  stats.usbBytesOut += i;
+  usbFlush(nowUs);
+  return i;
+}
+
+// as the RP2040 HAL does it: the endpoint is held (if it's idle) while the
+// batch goes into the FIFO, and flushed once at the end - or early, if the
+// FIFO fills
+uint32_t halUsbMidiWritePackets(const uint8_t *packets, uint32_t count) {
+  bool held        = !usbEndpointBusy;
+  uint32_t written = 0;
+  while (written < count) {
+    const uint8_t *packet = packets + written * USB_MIDI_PACKET_SIZE;
+    uint8_t length        = usbMidiPacketLength(packet);
+    if (usbFifoPackets == SIM_USB_FIFO_PACKETS && held) {
+      held = false;
+      usbFlush(nowUs);
+      continue;
+    }
+    if (!usbFifoPush()) {
+      break;
+    }
+    captureBytes(usbOut, "USB", packet + 1, length);
+    stats.usbBytesOut += length;
+    written++;
+  }
+  usbFlush(nowUs);
+  return written;
+}
+
+/*
+ * TRS MIDI: buffered until drained, like midi_uart_lib. Drained bytes then
+ * queue for the wire, which takes 320us a byte; a byte that finds the TX
+ * ring buffer full is lost.
+ */
+
+#define SIM_TRS_BYTE_US     320 // 10 bits at 31250 baud
+#define SIM_TRS_RING_BYTES  128 // midi_uart_lib's TX ring buffer
+
+static std::vector<uint8_t> trsBuffer;
+static uint64_t trsWireFreeUs = 0; // when the last queued byte will have gone
+
+void halUartMidiInit() {
+  trsBuffer.clear();
+  trsWireFreeUs = 0;
+}
+
+uint32_t halUartMidiWrite(const uint8_t *buf, uint32_t length) {
+  trsBuffer.insert(trsBuffer.end(), buf, buf + length);
+  return length;
+}
+
+void halUartMidiDrain() {
+  if (trsBuffer.empty()) {
+    return;
+  }
+  captureBytes(trsOut, "TRS", trsBuffer.data(), trsBuffer.size());
+  stats.trsBytesOut += trsBuffer.size();
+
+  for (size_t i = 0; i < trsBuffer.size(); i++) {
+    uint64_t start = trsWireFreeUs > nowUs ? trsWireFreeUs : nowUs;
+    if ((start - nowUs) / SIM_TRS_BYTE_US >= SIM_TRS_RING_BYTES) {
+      stats.trsBytesDropped++;
+      continue;
+    }
+    trsWireFreeUs   = start + SIM_TRS_BYTE_US;
+    uint32_t latency = trsWireFreeUs - nowUs;
+    if (latency > stats.trsMaxLatencyUs) {
+      stats.trsMaxLatencyUs = latency;
+    }
+  }
+  trsBuffer.clear();
+}
+
+/*
+ * core1
+ */
+
+void halLaunchCore1(void (*entry)()) {
+  fprintf(stderr, "sim: there is no core1\n");
+  abort();
+}
+
+/*
+ * setup / teardown
+ */
+
+static FILE *openOutput(const char *path) {
+  if (!path) {
+    return nullptr;
+  }
+  if (!strcmp(path, "-")) {
+    return stdout;
+  }
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "sim: can't open %s for writing\n", path);
+  }
+  return f;
+}
+
+static void closeOutput(FILE *f) {
+  if (f && f != stdout) {
+    fclose(f);
+  }
+}
+
+bool simInit(const SimOptions &options) {
+  nowUs = 0;
+  stats = SimStats();
+
+  i2cReadAllUs     = options.i2cReadAllMs * 1000;
+  nextI2cReadAllUs = 0;
+
+  usbTransferUs   = options.usbTransferUs;
+  usbFifoPackets  = 0;
+  usbEndpointBusy = false;
+  streamIndex     = 0;
+  streamInSysex   = false;
+
+  noiseLsb = options.noiseLsb;
+  noiseRng.seed(options.seed);
+  if (options.tracePath && !loadTrace(options.tracePath)) {
+    return false;
+  }
+  if (options.usbInPath && !loadUsbInput(options.usbInPath)) {
+    return false;
+  }
+
+  // a fresh flash image is erased; otherwise carry on from last time
+  memset(flashImage, 0xFF, sizeof(flashImage));
+  flashPath         = options.flashPath;
+  flashFailPrograms = 0;
+  flashTearAt       = -1;
+  if (flashPath) {
+    FILE *f = fopen(flashPath, "rb");
+    if (f) {
+      fread(flashImage, 1, sizeof(flashImage), f);
+      fclose(f);
+    }
+  }
+
+  usbOut = openOutput(options.usbOutPath);
+  trsOut = openOutput(options.trsOutPath);
+  i2cOut = openOutput(options.i2cOutPath);
+  return true;
+}
+
+void simShutdown() {
+  halUartMidiDrain();
+
+  if (flashPath) {
+    FILE *f = fopen(flashPath, "wb");
+    if (f) {
+      fwrite(flashImage, 1, sizeof(flashImage), f);
+      fclose(f);
+    }
+  }
+
+  closeOutput(usbOut);
+  closeOutput(trsOut);
+  closeOutput(i2cOut);
+  usbOut = trsOut = i2cOut = nullptr;
+}
+
+SimStats simStats() {
+  SimStats s      = stats;
+  s.framesScanned = scanSequencer.framesPublished();
+  return s;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Host (Linux) side of hal.h, for the simulator.
+ *
+ * Time is virtual: nothing happens until simAdvance() is called, at which
+ * point the fader scan is stepped exactly as the RP2040 alarm would step it.
+ * Faders are driven from a CSV trace, flash is a RAM image (optionally backed
+ * by a file), USB MIDI input is scripted, and everything the core writes to
+ * USB, TRS and I2C is captured as timestamped text lines.
+ */
+
+struct SimOptions {
+  const char *tracePath  = nullptr; // CSV: time_ms,f0,...,f15 (linearly interpolated)
+  const char *usbInPath  = nullptr; // lines of: time_ms hex-byte hex-byte ...
+  const char *usbOutPath = nullptr; // captured USB MIDI output
+  const char *trsOutPath = nullptr; // captured TRS MIDI output
+  const char *i2cOutPath = nullptr; // captured I2C leader writes
+  const char *flashPath  = nullptr; // flash image; loaded at start, saved at shutdown
+  uint16_t noiseLsb      = 0;       // uniform +/- noise added to every sample
+  uint32_t usbTransferUs = 100;     // how long the host takes to collect a USB IN transfer
+  uint32_t i2cReadAllMs  = 0;       // as follower, read every input this often (0: never)
+  uint32_t seed          = 1;       // seed for the noise
+};
+
+bool simInit(const SimOptions &options);
+void simShutdown();
+
+// advance the virtual clock, servicing the scan (and anything else that is
+// due) on the way
+void simAdvance(uint32_t us);
+uint64_t simNowUs();
+
+// I2C addresses that ACK leader writes (everything else NAKs), from fromMs
+// until untilMs (0: for good)
+void simI2cAddResponder(uint8_t address, uint32_t fromMs = 0, uint32_t untilMs = 0);
+// I2C addresses that hold the bus (SCL low) forever once written to
+void simI2cAddHung(uint8_t address);
+
+// act as an I2C leader talking to us while we are a follower: write one
+// byte (the input to read, or I2C_READ_ALL), then read length bytes back
+uint8_t simI2cFollowerRead(uint8_t command, uint8_t *buf, uint8_t length);
+
+// make the next count flash programs fail, leaving the flash as it was (so
+// the config store's read-back sees nothing there)
+void simFlashFailPrograms(uint32_t count);
+// as if the power went bytes into the next flash program: only those bytes
+// of it land
+void simFlashTearProgram(uint32_t bytes);
+
+struct SimStats {
+  uint32_t framesScanned;
+  uint32_t usbBytesOut;       // MIDI bytes, not counting packet headers
+  uint32_t usbPacketsOut;     // USB-MIDI event packets sent to the host
+  uint32_t usbTransfers;      // IN transfers they went in
+  uint32_t usbPacketsDropped; // packets that didn't fit in the TX FIFO
+  uint32_t trsBytesOut;
+  uint32_t trsBytesDropped;   // bytes that found the UART's TX buffer full
+  uint32_t trsMaxLatencyUs;   // longest a byte waited to get onto the wire
+  uint32_t i2cWrites;
+  uint32_t i2cNaks;           // leader writes that weren't ACKed
+  uint32_t i2cAborts;         // leader writes given up on (timed out)
+  uint32_t i2cReads;          // follower reads of every input
+  uint32_t flashErases;
+  uint32_t flashPrograms;
+  uint32_t flashProgramsFailed; // made to fail by simFlashFailPrograms()
+};
+
+SimStats simStats();
@@ -0,0 +1,378 @@
+/**
+ * MIDI parser fuzz and throughput bench
+ *
+ * Builds dense MIDI streams - clock between (and inside) messages, running
+ * status, sysex of every length up to and past the parser's buffer - along
+ * with the messages the parser ought to find in them. With --check it:
+ *
+ * - parses each stream in one go, and again in random chunk sizes, and
+ *   checks both give exactly the expected messages
+ * - parses random bytes, and checks everything that comes out is well
+ *   formed
+ *
+ * and exits non-zero if any check fails; ctest runs it that way. Otherwise it
+ * times parsing a long dense stream (host ns per byte: only meaningful
+ * relative to other runs, not M0+ cycles).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "main.h"
+#include "midi_parser.h"
+
+typedef MidiParser<SYSEX_BUFFER_SIZE> Parser;
+
+// one message as the parser delivers it
+struct Event {
+  uint8_t kind; // 'm'essage, 'r'ealtime, 's'ysex or 'l'ong sysex (in parts)
+  std::vector<uint8_t> bytes;
+
+  bool operator==(const Event &other) const {
+    return kind == other.kind && bytes == other.bytes;
+  }
+};
+
+class RecordingHandler : public MidiHandler {
+  public:
+  void midiMessage(const uint8_t *message, uint8_t length) override {
+    events.push_back({'m', std::vector<uint8_t>(message, message + length)});
+  }
+  void midiRealtime(uint8_t status) override {
+    events.push_back({'r', {status}});
+  }
+  void midiSysex(uint8_t *message, uint16_t length) override {
+    events.push_back({'s', std::vector<uint8_t>(message, message + length)});
+  }
+  // parts are put back together, and recorded once the last arrives
+  void midiSysexPart(const uint8_t *data, uint16_t length, bool last) override {
+    parts.insert(parts.end(), data, data + length);
+    if (last) {
+      events.push_back({'l', parts});
+      parts.clear();
+    }
+  }
+
+  std::vector<Event> events;
+  std::vector<uint8_t> parts;
+};
+
+// counts, without storing anything: for timing
+class CountingHandler : public MidiHandler {
+  public:
+  void midiMessage(const uint8_t *message, uint8_t length) override {
+    messages++;
+    checksum += message[length - 1];
+  }
+  void midiRealtime(uint8_t status) override {
+    realtime++;
+  }
+  void midiSysex(uint8_t *message, uint16_t length) override {
+    sysex++;
+    checksum += length;
+  }
+  void midiSysexPart(const uint8_t *data, uint16_t length, bool last) override {
+    sysex += last;
+    checksum += length;
+  }
+
+  uint32_t messages = 0, realtime = 0, sysex = 0, checksum = 0;
+};
+
+/*
+ * Stream generation
+ */
+
+struct Stream {
+  std::vector<uint8_t> bytes;
+  std::vector<Event> expected;
+};
+
+class StreamBuilder {
+  public:
+  StreamBuilder(uint32_t seed, float clockDensity) : rng(seed), clockDensity(clockDensity) {}
+
+  Stream build(uint32_t messages) {
+    for (uint32_t i = 0; i < messages; i++) {
+      uint32_t r = rng() % 100;
+      if (r < 40) {
+        channelMessage();
+      } else if (r < 55) {
+        sysex();
+      } else if (r < 60) {
+        systemCommon();
+      } else {
+        realtime();
+      }
+    }
+    return stream;
+  }
+
+  private:
+  // maybe a clock byte here; the parser should deliver it straight away
+  void maybeClock() {
+    if (uniform(rng) < clockDensity) {
+      realtime();
+    }
+  }
+
+  void realtime() {
+    static const uint8_t bytes[] = {0xF8, 0xF8, 0xF8, 0xFA, 0xFB, 0xFC, 0xFE, 0xFF};
+    uint8_t status               = bytes[rng() % sizeof(bytes)];
+    stream.bytes.push_back(status);
+    stream.expected.push_back({'r', {status}});
+  }
+
+  // a status byte, which ends any sysex cut short
+  void statusByte(uint8_t status) {
+    stream.bytes.push_back(status);
+    if (!cutShort.bytes.empty()) {
+      stream.expected.push_back(cutShort);
+      cutShort.bytes.clear();
+    }
+  }
+
+  void channelMessage() {
+    uint8_t status = 0x80 | (rng() % 7) << 4 | (rng() % 16);
+    uint8_t length = (status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0 ? 2 : 3;
+    bool running   = status == runningStatus && rng() % 2;
+
+    Event event    = {'m', {status}};
+    if (!running) {
+      statusByte(status);
+    }
+    for (uint8_t i = 1; i < length; i++) {
+      maybeClock();
+      uint8_t data = rng() % 128;
+      stream.bytes.push_back(data);
+      event.bytes.push_back(data);
+    }
+    // realtime bytes land in the expected list as they're written, so the
+    // message itself goes after any clock inside it
+    stream.expected.push_back(event);
+    runningStatus = status;
+  }
+
+  void systemCommon() {
+    static const uint8_t statuses[] = {0xF1, 0xF2, 0xF3, 0xF6};
+    uint8_t status                  = statuses[rng() % sizeof(statuses)];
+    uint8_t length                  = status == 0xF2 ? 3 : status == 0xF6 ? 1 : 2;
+
+    Event event                     = {'m', {status}};
+    statusByte(status);
+    for (uint8_t i = 1; i < length; i++) {
+      uint8_t data = rng() % 128;
+      stream.bytes.push_back(data);
+      event.bytes.push_back(data);
+    }
+    stream.expected.push_back(event);
+    runningStatus = 0; // system common cancels running status
+  }
+
+  void sysex() {
+    // mostly ones that fit, some right at the edge, some too long
+    uint32_t length;
+    uint32_t r = rng() % 10;
+    if (r < 6) {
+      length = rng() % (SYSEX_BUFFER_SIZE - 2);
+    } else if (r < 8) {
+      length = SYSEX_BUFFER_SIZE - 3 + rng() % 3;
+    } else {
+      length = SYSEX_BUFFER_SIZE + rng() % 200;
+    }
+    bool truncated = rng() % 20 == 0; // cut short by a new status byte
+
+    Event event    = {'s', {0xF0}};
+    statusByte(0xF0);
+    for (uint32_t i = 0; i < length; i++) {
+      maybeClock();
+      uint8_t data = rng() % 128;
+      stream.bytes.push_back(data);
+      event.bytes.push_back(data);
+    }
+    runningStatus = 0;
+    event.bytes.push_back(0xF7);
+    // too long to deliver whole, it comes in parts; once it has started, one
+    // cut short is ended with an 0xF7
+    if (event.bytes.size() > SYSEX_BUFFER_SIZE) {
+      event.kind = 'l';
+    }
+
+    if (truncated) {
+      // the next message's status byte ends it
+      if (event.kind == 'l') {
+        cutShort = event;
+      }
+      return;
+    }
+    stream.bytes.push_back(0xF7);
+    stream.expected.push_back(event);
+  }
+
+  std::mt19937 rng;
+  std::uniform_real_distribution<float> uniform{0, 1};
+  float clockDensity;
+  uint8_t runningStatus = 0;
+  Event cutShort        = {'l', {}}; // a long sysex waiting to be ended
+  Stream stream;
+};
+
+/*
+ * Checks
+ */
+
+static std::vector<Event> parseInChunks(const std::vector<uint8_t> &bytes, std::mt19937 &rng, uint32_t maxChunk) {
+  Parser parser;
+  RecordingHandler handler;
+  for (size_t offset = 0; offset < bytes.size();) {
+    size_t chunk = 1 + rng() % maxChunk;
+    if (offset + chunk > bytes.size()) {
+      chunk = bytes.size() - offset;
+    }
+    parser.parse(bytes.data() + offset, chunk, handler);
+    offset += chunk;
+  }
+  return handler.events;
+}
+
+static bool sameEvents(const char *what, uint32_t seed, const std::vector<Event> &got,
+                       const std::vector<Event> &expected) {
+  if (got == expected) {
+    return true;
+  }
+  size_t i = 0;
+  while (i < got.size() && i < expected.size() && got[i] == expected[i]) {
+    i++;
+  }
+  fprintf(stderr, "FAIL %s (seed %u): %zu events, expected %zu; first difference at event %zu\n", what, seed,
+          got.size(), expected.size(), i);
+  return false;
+}
+
+// everything the parser delivers from garbage must still be well formed
+static bool wellFormed(uint32_t seed, const std::vector<Event> &events) {
+  for (const Event &event : events) {
+    const std::vector<uint8_t> &b = event.bytes;
+    bool ok                       = !b.empty() && b[0] >= 0x80;
+    for (size_t i = 1; ok && i < b.size(); i++) {
+      ok = b[i] < 0x80 || (event.kind != 'm' && i == b.size() - 1);
+    }
+    if (ok && event.kind == 'r') {
+      ok = b.size() == 1 && b[0] >= 0xF8;
+    } else if (ok && event.kind == 's') {
+      ok = b.size() >= 2 && b.size() <= SYSEX_BUFFER_SIZE && b[0] == 0xF0 && b.back() == 0xF7;
+    } else if (ok && event.kind == 'l') {
+      ok = b.size() > SYSEX_BUFFER_SIZE && b[0] == 0xF0 && b.back() == 0xF7;
+    } else if (ok && event.kind == 'm') {
+      uint8_t type     = b[0] < 0xF0 ? b[0] & 0xF0 : b[0];
+      size_t length    = type == 0xC0 || type == 0xD0 || type == 0xF1 || type == 0xF3 ? 2
+                         : type == 0xF6                                           ? 1
+                                                                                  : 3;
+      ok               = b.size() == length && b[0] != 0xF0 && b[0] != 0xF7 && b[0] < 0xF8;
+    }
+    if (!ok) {
+      fprintf(stderr, "FAIL fuzz (seed %u): malformed '%c' event of %zu bytes\n", seed, event.kind, b.size());
+      return false;
+    }
+  }
+  return true;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: 16next_midi_bench [options]\n"
+          "  --check          check the parser instead of timing it\n"
+          "  --seed N         first seed (default 1)\n"
+          "  --iterations N   streams to check (default 200)\n"
+          "  --megabytes N    size of the timed stream (default 16)\n");
+}
+
+// parses generated streams and garbage; returns false if any check fails
+static bool check(uint32_t seed, uint32_t iterations) {
+  bool ok         = true;
+  uint64_t events = 0;
+
+  for (uint32_t n = 0; n < iterations && ok; n++) {
+    uint32_t s    = seed + n;
+    std::mt19937 rng(s);
+
+    // from sparse to every other byte being clock
+    Stream stream = StreamBuilder(s, (n % 5) * 0.25f).build(500);
+    events += stream.expected.size();
+
+    Parser parser;
+    RecordingHandler whole;
+    parser.parse(stream.bytes.data(), stream.bytes.size(), whole);
+    ok = ok && sameEvents("whole stream", s, whole.events, stream.expected);
+    ok = ok && sameEvents("64-byte chunks", s, parseInChunks(stream.bytes, rng, MIDI_INPUT_BUFFER), stream.expected);
+    ok = ok && sameEvents("single bytes", s, parseInChunks(stream.bytes, rng, 1), stream.expected);
+
+    // and garbage
+    std::vector<uint8_t> noise(4096);
+    for (uint8_t &b : noise) {
+      // weighted towards data bytes, so messages actually complete
+      b = rng() % 4 ? rng() % 128 : rng() % 256;
+    }
+    ok = ok && wellFormed(s, parseInChunks(noise, rng, MIDI_INPUT_BUFFER));
+  }
+
+  printf("checked %u streams, %llu events: %s\n", iterations, (unsigned long long)events, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  uint32_t seed       = 1;
+  uint32_t iterations = 200;
+  uint32_t megabytes  = 16;
+  bool checking       = false;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg   = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+    if (!strcmp(arg, "--check")) {
+      checking = true;
+    } else if (!strcmp(arg, "--seed") && value) {
+      seed = strtoul(argv[++i], nullptr, 0);
+    } else if (!strcmp(arg, "--iterations") && value) {
+      iterations = strtoul(argv[++i], nullptr, 0);
+    } else if (!strcmp(arg, "--megabytes") && value) {
+      megabytes = strtoul(argv[++i], nullptr, 0);
+    } else {
+      usage();
+      return !strcmp(arg, "--help") ? 0 : 1;
+    }
+  }
+
+  if (checking) {
+    return check(seed, iterations) ? 0 : 1;
+  }
+
+  // throughput: a dense stream (clock at half the bytes, plus sysex), in
+  // USB-sized chunks
+  std::vector<uint8_t> dense;
+  for (uint32_t s = seed; dense.size() < (size_t)megabytes << 20; s++) {
+    Stream stream = StreamBuilder(s, 1.0f).build(2000);
+    dense.insert(dense.end(), stream.bytes.begin(), stream.bytes.end());
+  }
+
+  Parser parser;
+  CountingHandler counter;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t offset = 0; offset < dense.size(); offset += MIDI_INPUT_BUFFER) {
+    size_t chunk = dense.size() - offset < MIDI_INPUT_BUFFER ? dense.size() - offset : MIDI_INPUT_BUFFER;
+    parser.parse(dense.data() + offset, chunk, counter);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("parsed %zu bytes in %.3fs: %.2f ns/byte, %.1f MB/s (%u messages, %u realtime, %u sysex, %u dropped, "
+         "checksum %u)\n",
+         dense.size(), seconds, seconds * 1e9 / dense.size(), dense.size() / seconds / (1 << 20), counter.messages,
+         counter.realtime, counter.sysex, parser.dropped(), counter.checksum);
+  return 0;
+}
@@ -0,0 +1,149 @@
+/**
+ * 16next simulator
+ *
+ * Runs the faderbank core (lib/) against the host HAL: fader positions come
+ * from a trace, and USB/TRS/I2C output is captured to files. See README.md.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "faderbank.h"
+#include "hal_host.h"
+#include "latency.h"
+#include "main.h"
+
+// how often the main loop gets to run, in virtual time
+#define SIM_LOOP_PERIOD_US 50
+
+static void usage() {
+  fprintf(stderr,
+          "usage: 16next_sim [options]\n"
+          "  --trace FILE        fader trace CSV (time_ms,f0,...,f15)\n"
+          "  --duration-ms N     how long to run for (default 1000)\n"
+          "  --noise N           add +/- N LSB of noise to every sample\n"
+          "  --seed N            noise seed\n"
+          "  --usb-transfer-us N how long the host takes to collect a USB transfer (default 100)\n"
+          "  --usb-in FILE       scripted USB MIDI input (time_ms hex bytes...)\n"
+          "  --usb-out FILE      capture USB MIDI output ('-' for stdout)\n"
+          "  --trs-out FILE      capture TRS MIDI output\n"
+          "  --i2c-out FILE      capture I2C leader writes\n"
+          "  --i2c-device ADDR[@FROM_MS[-UNTIL_MS]]\n"
+          "                      an I2C address that ACKs writes (repeatable); optionally\n"
+          "                      only from/until a time, to plug/unplug it\n"
+          "  --i2c-hung ADDR     an I2C address that hangs the bus when written to\n"
+          "  --i2c-read-all-ms N as follower, read every input at once this often\n"
+          "  --flash FILE        flash image to load, and save on exit\n");
+}
+
+int main(int argc, char **argv) {
+  SimOptions options;
+  uint32_t durationMs = 1000;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg   = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+    if (!strcmp(arg, "--help") || !strcmp(arg, "-h")) {
+      usage();
+      return 0;
+    }
+    if (!value) {
+      usage();
+      return 1;
+    }
+    i++;
+
+    if (!strcmp(arg, "--trace")) {
+      options.tracePath = value;
+    } else if (!strcmp(arg, "--duration-ms")) {
+      durationMs = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--noise")) {
+      options.noiseLsb = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--seed")) {
+      options.seed = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--usb-transfer-us")) {
+      options.usbTransferUs = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--usb-in")) {
+      options.usbInPath = value;
+    } else if (!strcmp(arg, "--usb-out")) {
+      options.usbOutPath = value;
+    } else if (!strcmp(arg, "--trs-out")) {
+      options.trsOutPath = value;
+    } else if (!strcmp(arg, "--i2c-out")) {
+      options.i2cOutPath = value;
+    } else if (!strcmp(arg, "--i2c-device")) {
+      // ADDR[@FROM_MS[-UNTIL_MS]]
+      char *end;
+      uint8_t address = strtoul(value, &end, 0);
+      uint32_t fromMs = 0, untilMs = 0;
+      if (*end == '@') {
+        fromMs = strtoul(end + 1, &end, 0);
+      }
+      if (*end == '-') {
+        untilMs = strtoul(end + 1, &end, 0);
+      }
+      simI2cAddResponder(address, fromMs, untilMs);
+    } else if (!strcmp(arg, "--i2c-hung")) {
+      simI2cAddHung(strtoul(value, nullptr, 0));
+    } else if (!strcmp(arg, "--i2c-read-all-ms")) {
+      options.i2cReadAllMs = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--flash")) {
+      options.flashPath = value;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  if (!simInit(options)) {
+    return 1;
+  }
+
+  faderbankSetup();
+
+  uint64_t endUs = simNowUs() + (uint64_t)durationMs * 1000;
+  while (simNowUs() < endUs) {
+    faderbankLoop();
+    simAdvance(SIM_LOOP_PERIOD_US);
+  }
+
+  simShutdown();
+
+  SimStats stats = simStats();
+  fprintf(stderr, "frames=%u usb_bytes=%u trs_bytes=%u i2c_writes=%u flash_erases=%u flash_programs=%u\n",
+          stats.framesScanned, stats.usbBytesOut, stats.trsBytesOut, stats.i2cWrites, stats.flashErases,
+          stats.flashPrograms);
+
+  fprintf(stderr, "usb_packets=%u usb_transfers=%u packets_per_transfer=%.2f usb_packets_dropped=%u\n",
+          stats.usbPacketsOut, stats.usbTransfers,
+          stats.usbTransfers ? (double)stats.usbPacketsOut / stats.usbTransfers : 0.0, stats.usbPacketsDropped);
+
+  fprintf(stderr, "trs_bytes_dropped=%u trs_max_latency_us=%u\n", stats.trsBytesDropped, stats.trsMaxLatencyUs);
+
+  fprintf(stderr, "i2c_naks=%u i2c_aborts=%u i2c_reads=%u\n", stats.i2cNaks, stats.i2cAborts, stats.i2cReads);
+
+#ifdef LATENCY_INSTRUMENTATION
+  // how old readings were at each stage: count, min/mean/max (us), then the
+  // log2 histogram
+  static const char *stageNames[LATENCY_STAGES] = {"scan", "filter", "usb", "trs", "i2c"};
+  for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+    const LatencyStats &latency = latencyStats[stage];
+    fprintf(stderr, "latency_%s count=%u min=%u mean=%.0f max=%u buckets=", stageNames[stage], latency.count,
+            latency.min, latency.count ? (double)latency.total / latency.count : 0.0, latency.max);
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      fprintf(stderr, "%s%u", b ? "," : "", latency.buckets[b]);
+    }
+    fprintf(stderr, "\n");
+  }
+#endif
+
+  // effective scan rates over the last whole second
+  fprintf(stderr, "scan_rates_hz=");
+  for (int i = 0; i < FADER_COUNT; i++) {
+    fprintf(stderr, "%s%u", i ? "," : "", scanRates[i]);
+  }
+  fprintf(stderr, "\n");
+  return 0;
+}
@@ -0,0 +1,659 @@
+/**
+ * 16next simulator tests
+ *
+ * Scenarios run against the host HAL, one per process: the core keeps its
+ * state in globals, so ctest runs `16next_sim_tests NAME` for each test in
+ * SIXTEEN_NEXT_SIM_TESTS (sim/CMakeLists.txt). A test prints the check that
+ * failed and exits non-zero.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "config.h"
+#include "config_store.h"
+#include "faderbank.h"
+#include "hal_host.h"
+#include "main.h"
+#include "trs_midi.h"
+
+#define CHECK(condition)                                                                   \
+  do {                                                                                     \
+    if (!(condition)) {                                                                    \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);        \
+      return false;                                                                        \
+    }                                                                                      \
+  } while (0)
+
+// the loop period 16next_sim runs the core at
+#define TEST_LOOP_PERIOD_US 50
+
+struct CaptureLine {
+  uint64_t us;
+  std::vector<uint8_t> bytes;
+};
+
+// the lines captured with tag (eg, "TRS") in a --*-out style file
+static std::vector<CaptureLine> readCaptureLines(const char *path, const char *tag) {
+  std::vector<CaptureLine> lines;
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return lines;
+  }
+  char text[4096];
+  while (fgets(text, sizeof(text), f)) {
+    char *p = strchr(text, ' ');
+    if (!p || strncmp(p + 1, tag, strlen(tag)) != 0) {
+      continue;
+    }
+    CaptureLine line;
+    line.us = strtoull(text, nullptr, 10);
+    p += 1 + strlen(tag);
+    char *end;
+    for (unsigned long byte = strtoul(p, &end, 16); end != p; byte = strtoul(p, &end, 16)) {
+      line.bytes.push_back((uint8_t)byte);
+      p = end;
+    }
+    lines.push_back(line);
+  }
+  fclose(f);
+  return lines;
+}
+
+// every byte captured with tag, run together
+static std::vector<uint8_t> readCapture(const char *path, const char *tag) {
+  std::vector<uint8_t> bytes;
+  for (const CaptureLine &line : readCaptureLines(path, tag)) {
+    bytes.insert(bytes.end(), line.bytes.begin(), line.bytes.end());
+  }
+  return bytes;
+}
+
+// the last value of a USB control change sent by atUs, or -1
+static int lastControlChange(const std::vector<CaptureLine> &lines, uint8_t status, uint8_t cc, uint64_t atUs) {
+  int value = -1;
+  for (const CaptureLine &line : lines) {
+    if (line.us <= atUs && line.bytes.size() == 3 && line.bytes[0] == status && line.bytes[1] == cc) {
+      value = line.bytes[2];
+    }
+  }
+  return value;
+}
+
+// write a fader trace: rows of time_ms and fader 0's position, the other
+// faders at 0
+static bool writeTrace(const char *path, const std::vector<std::pair<uint32_t, uint16_t>> &rows) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    return false;
+  }
+  for (const auto &row : rows) {
+    fprintf(f, "%u,%u", row.first, row.second);
+    for (int i = 1; i < 16; i++) {
+      fprintf(f, ",0");
+    }
+    fprintf(f, "\n");
+  }
+  fclose(f);
+  return true;
+}
+
+// run the faderbank's main loop for ms
+static void runFaderbank(uint32_t ms) {
+  for (uint32_t t = 0; t < ms * 1000; t += TEST_LOOP_PERIOD_US) {
+    faderbankLoop();
+    simAdvance(TEST_LOOP_PERIOD_US);
+  }
+}
+
+// where needle first appears in bytes, or -1
+static int findBytes(const std::vector<uint8_t> &bytes, const std::vector<uint8_t> &needle) {
+  for (size_t i = 0; i + needle.size() <= bytes.size(); i++) {
+    if (std::equal(needle.begin(), needle.end(), bytes.begin() + i)) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+// write a sysex for us at ms to a --usb-in file: the header, command, four
+// bytes of device ID and firmware version (ignored), then the payload
+static void writeSysex(FILE *f, uint32_t ms, uint8_t command, const uint8_t *payload, uint16_t length) {
+  fprintf(f, "%u F0 7D 00 00 %02X 00 00 00 00", ms, command);
+  for (uint16_t i = 0; i < length; i++) {
+    fprintf(f, " %02X", payload[i]);
+  }
+  fprintf(f, " F7\n");
+}
+
+template <uint8_t CAPACITY>
+static void runTrs(TrsMidiEncoder<CAPACITY> &trs, uint32_t ms) {
+  for (uint32_t t = 0; t < ms * 1000; t += TEST_LOOP_PERIOD_US) {
+    trs.encode(halMicros());
+    halUartMidiDrain();
+    simAdvance(TEST_LOOP_PERIOD_US);
+  }
+}
+
+/*
+ * Config store
+ */
+
+// saves that never read back walk the log round to the sector holding the
+// current record, which must survive them; once flash works again, the
+// next save lands
+static bool testConfigStoreVerifyFailures() {
+  static uint8_t saved[CONFIG_STORE_MAX_LENGTH];
+  static uint8_t update[CONFIG_STORE_MAX_LENGTH];
+  static uint8_t loaded[CONFIG_STORE_MAX_LENGTH];
+  memset(saved, 0x11, sizeof(saved));
+  memset(update, 0x22, sizeof(update));
+
+  CHECK(simInit(SimOptions()));
+  configStoreInit(0);
+  CHECK(configStoreSave(saved, sizeof(saved)));
+
+  // more failures than there are sectors
+  simFlashFailPrograms(2 * HAL_STORAGE_SECTORS);
+  for (int i = 0; i < 2 * HAL_STORAGE_SECTORS; i++) {
+    CHECK(!configStoreSave(update, sizeof(update)));
+    configStorePrepare();
+  }
+
+  // as if rebooted: the record saved before the failures is still the head
+  configStoreInit(0);
+  CHECK(configStoreLoad(loaded, sizeof(loaded)));
+  CHECK(memcmp(loaded, saved, sizeof(saved)) == 0);
+
+  simFlashFailPrograms(0);
+  CHECK(configStoreSave(update, sizeof(update)));
+  configStoreInit(0);
+  CHECK(configStoreLoad(loaded, sizeof(loaded)));
+  CHECK(memcmp(loaded, update, sizeof(update)) == 0);
+
+  simShutdown();
+  return true;
+}
+
+// a save torn by a power cut, anywhere in its header or payload, leaves the
+// record before it as the config after a reboot - all the way round the log
+// and back, several times
+static bool testConfigStoreTornWrite() {
+  const uint16_t length = 600;
+  const uint32_t size   = (sizeof(ConfigRecordHeader) + length + HAL_FLASH_PAGE_SIZE - 1) / HAL_FLASH_PAGE_SIZE * HAL_FLASH_PAGE_SIZE;
+  const int records     = 3 * HAL_STORAGE_SECTORS * (HAL_FLASH_SECTOR_SIZE / size);
+  static uint8_t good[CONFIG_STORE_MAX_LENGTH];
+  static uint8_t torn[CONFIG_STORE_MAX_LENGTH];
+  static uint8_t loaded[CONFIG_STORE_MAX_LENGTH];
+
+  CHECK(simInit(SimOptions()));
+  for (int i = 0; i < records; i++) {
+    memset(good, i, length);
+    memset(torn, 0x80 | i, length);
+
+    configStoreInit(0);
+    CHECK(configStoreSave(good, length));
+    simFlashTearProgram(i * 97 % (sizeof(ConfigRecordHeader) + length));
+    CHECK(!configStoreSave(torn, length));
+
+    // as if rebooted
+    configStoreInit(0);
+    CHECK(configStoreLoad(loaded, length));
+    CHECK(memcmp(loaded, good, length) == 0);
+  }
+  simShutdown();
+  return true;
+}
+
+// a burst of edits is committed as one record, once they've stopped for
+// CONFIG_STORE_COMMIT_DELAY_MS; edits that put things back write nothing
+static bool testDebouncedCommit() {
+  SimOptions options;
+  uint8_t memoryMap[MEMORY_MAP_LENGTH];
+  memcpy(memoryMap, defaultMemoryMap, sizeof(memoryMap));
+  CHECK(simInit(options));
+  configStoreInit(0);
+  CHECK(configStoreSave(defaultMemoryMap, MEMORY_MAP_LENGTH));
+
+  faderbankSetup();
+  uint32_t sequence = configStoreSequence();
+  // fader 0's USB CC, three times, 300ms apart
+  for (int i = 0; i < 3; i++) {
+    memoryMap[48] = 50 + i;
+    configStoreQueue(memoryMap, sizeof(memoryMap));
+    runFaderbank(300);
+  }
+  runFaderbank(CONFIG_STORE_COMMIT_DELAY_MS - 400);
+  CHECK(configStorePending());
+  CHECK(configStoreSequence() == sequence);
+  runFaderbank(200);
+  CHECK(!configStorePending());
+  CHECK(configStoreSequence() == sequence + 1);
+
+  // and later, away and back again
+  memoryMap[48] = 60;
+  configStoreQueue(memoryMap, sizeof(memoryMap));
+  runFaderbank(300);
+  memoryMap[48] = 52;
+  configStoreQueue(memoryMap, sizeof(memoryMap));
+  runFaderbank(CONFIG_STORE_COMMIT_DELAY_MS + 100);
+  CHECK(!configStorePending());
+  CHECK(configStoreSequence() == sequence + 1);
+
+  // as if rebooted: the last edit of the burst is what was kept
+  configStoreInit(0);
+  CHECK(configStoreLoad(memoryMap, sizeof(memoryMap)));
+  CHECK(memoryMap[48] == 52);
+  simShutdown();
+  return true;
+}
+
+// each partial edit changes its own section of the memory map, and takes
+// effect, leaving the rest as it was
+static bool testPartialEdits() {
+  SimOptions options;
+  options.tracePath  = "partial_edits.csv";
+  options.usbInPath  = "partial_edits_in.txt";
+  options.usbOutPath = "partial_edits_out.txt";
+  options.trsOutPath = options.usbOutPath;
+  CHECK(writeTrace(options.tracePath, {{0, 0}, {500, 0}, {1000, 4095}, {1200, 4095}}));
+
+  uint8_t memoryMap[MEMORY_MAP_LENGTH];
+  memcpy(memoryMap, defaultMemoryMap, sizeof(memoryMap));
+  memoryMap[80] = 0x7F; // high-res USB and TRS, which no partial edit touches
+  memoryMap[83] = 0x7F;
+  uint8_t device[16], usb[32], trs[32];
+  memcpy(device, memoryMap, sizeof(device));
+  device[0] = 1;
+  device[9] = 3;
+  for (int i = 0; i < 16; i++) {
+    usb[i]      = 2;
+    usb[16 + i] = 70 + i;
+    trs[i]      = 3;
+    trs[16 + i] = 90 + i;
+  }
+
+  FILE *f = fopen(options.usbInPath, "w");
+  CHECK(f);
+  writeSysex(f, 100, 0x0D, device, sizeof(device));
+  writeSysex(f, 200, 0x0C, usb, sizeof(usb));
+  writeSysex(f, 300, 0x0B, trs, sizeof(trs));
+  fclose(f);
+  CHECK(simInit(options));
+  configStoreInit(0);
+  CHECK(configStoreSave(memoryMap, sizeof(memoryMap)));
+  faderbankSetup();
+
+  // after each edit, the image is what it was with just that section changed
+  runFaderbank(150);
+  memcpy(memoryMap, device, sizeof(device));
+  CHECK(memcmp(configStoreImage(), memoryMap, sizeof(memoryMap)) == 0);
+  runFaderbank(100);
+  memcpy(memoryMap + 16, usb, 16);
+  memcpy(memoryMap + 48, usb + 16, 16);
+  CHECK(memcmp(configStoreImage(), memoryMap, sizeof(memoryMap)) == 0);
+  runFaderbank(100);
+  memcpy(memoryMap + 32, trs, 16);
+  memcpy(memoryMap + 64, trs + 16, 16);
+  CHECK(memcmp(configStoreImage(), memoryMap, sizeof(memoryMap)) == 0);
+  runFaderbank(850);
+  simShutdown();
+
+  // fader 0 goes out on the new channels and CCs, still in high-res
+  std::vector<CaptureLine> usbOut = readCaptureLines(options.usbOutPath, "USB");
+  CHECK(lastControlChange(usbOut, 0xB1, 70, 1200000) == 127);
+  CHECK(lastControlChange(usbOut, 0xB1, 70 + 32, 1200000) >= 0);
+  CHECK(lastControlChange(usbOut, 0xB0, 32, 1200000) == -1);
+  std::vector<uint8_t> trsOut = readCapture(options.trsOutPath, "TRS");
+  CHECK(findBytes(trsOut, {0xB2, 90}) >= 0);
+  CHECK(findBytes(trsOut, {0xB0}) == -1);
+  return true;
+}
+
+/*
+ * Calibration
+ */
+
+// a config from before per-fader calibration, with FADERMIN/FADERMAX set
+// (as 12-bit readings): the faders' travel between them still spans 0-127
+static bool testLegacyEndpoints() {
+  SimOptions options;
+  options.tracePath  = "legacy_endpoints.csv";
+  options.usbOutPath = "legacy_endpoints_usb.txt";
+  CHECK(writeTrace(options.tracePath,
+                   {{0, 100}, {500, 100}, {600, 2050}, {1100, 2050}, {1200, 4000}, {1700, 4000}}));
+  CHECK(simInit(options));
+
+  // just a memory map: no calibration after it
+  uint8_t memoryMap[MEMORY_MAP_LENGTH];
+  memcpy(memoryMap, defaultMemoryMap, sizeof(memoryMap));
+  memoryMap[4] = 100 & 0x7F;
+  memoryMap[5] = 100 >> 7;
+  memoryMap[6] = 4000 & 0x7F;
+  memoryMap[7] = 4000 >> 7;
+  configStoreInit(0);
+  CHECK(configStoreSave(memoryMap, sizeof(memoryMap)));
+
+  faderbankSetup();
+  runFaderbank(1700);
+  simShutdown();
+
+  // fader 0 is CC 32 on channel 1 (and 0 is where it starts, so at the
+  // bottom nothing may have been sent yet)
+  std::vector<CaptureLine> usb = readCaptureLines(options.usbOutPath, "USB");
+  CHECK(lastControlChange(usb, 0xB0, 32, 500000) <= 0);
+  int middle = lastControlChange(usb, 0xB0, 32, 1100000);
+  CHECK(middle >= 62 && middle <= 65);
+  CHECK(lastControlChange(usb, 0xB0, 32, 1700000) == 127);
+  return true;
+}
+
+/*
+ * Destinations
+ */
+
+// a route edit with a 14-bit CC above 31 (whose LSB would be CC 132) mustn't
+// put anything but a status byte at 0x80 or above on either port
+static bool testCc14DestinationRange() {
+  SimOptions options;
+  options.tracePath  = "cc14_destination_range.csv";
+  options.usbInPath  = "cc14_destination_range_in.txt";
+  options.usbOutPath = "cc14_destination_range_out.txt";
+  options.trsOutPath = options.usbOutPath;
+  CHECK(writeTrace(options.tracePath, {{0, 0}, {200, 0}, {1200, 4095}, {1500, 4095}}));
+  FILE *f = fopen(options.usbInPath, "w");
+  CHECK(f);
+  // fader 0: a 14-bit CC 100 on channel 1, to USB and TRS, and CC 5 on
+  // channel 2 to USB
+  fprintf(f, "100 F0 7D 00 00 06 00 00 00 00 00 1A 01 64 00 09 02 05 00");
+  for (int i = 2; i < FADER_DESTINATIONS; i++) {
+    fprintf(f, " 00 00 00 00");
+  }
+  fprintf(f, " F7\n");
+  fclose(f);
+  CHECK(simInit(options));
+
+  faderbankSetup();
+  runFaderbank(1500);
+  simShutdown();
+
+  std::vector<CaptureLine> usb = readCaptureLines(options.usbOutPath, "USB");
+  for (const CaptureLine &line : usb) {
+    CHECK(!line.bytes.empty() && line.bytes[0] >= 0x80);
+    if (line.bytes[0] != 0xF0) {
+      for (size_t i = 1; i < line.bytes.size(); i++) {
+        CHECK(line.bytes[i] < 0x80);
+      }
+    }
+  }
+  // the edit went in, and nothing went out for CC 100
+  CHECK(lastControlChange(usb, 0xB1, 5, 1500000) == 127);
+  CHECK(lastControlChange(usb, 0xB0, 100, 1500000) == -1);
+  for (uint8_t byte : readCapture(options.trsOutPath, "TRS")) {
+    CHECK(byte < 0x80 || byte >= 0xF0 || (byte & 0xF0) == 0xB0);
+  }
+  return true;
+}
+
+// high-res mode in the memory map: the default CCs (32-47) put their LSB
+// on CC + 32, and a CC above 95, which has no CC + 32, goes out 7-bit
+static bool testHighResMemoryMap() {
+  SimOptions options;
+  options.tracePath  = "high_res_memory_map.csv";
+  options.usbOutPath = "high_res_memory_map_out.txt";
+  options.trsOutPath = options.usbOutPath;
+  CHECK(writeTrace(options.tracePath, {{0, 0}, {100, 0}, {1100, 4095}, {1300, 4095}}));
+  CHECK(simInit(options));
+
+  // fader 0: high-res on both ports, on CC 32 for USB and CC 100 for TRS
+  uint8_t memoryMap[MEMORY_MAP_LENGTH];
+  memcpy(memoryMap, defaultMemoryMap, sizeof(memoryMap));
+  memoryMap[64] = 100;
+  memoryMap[80] = 1;
+  memoryMap[83] = 1;
+  configStoreInit(0);
+  CHECK(configStoreSave(memoryMap, sizeof(memoryMap)));
+
+  faderbankSetup();
+  runFaderbank(1300);
+  simShutdown();
+
+  std::vector<CaptureLine> usb = readCaptureLines(options.usbOutPath, "USB");
+  CHECK(lastControlChange(usb, 0xB0, 32, 1300000) == 127);
+  CHECK(lastControlChange(usb, 0xB0, 64, 1300000) == 127);
+  std::vector<uint8_t> trs = readCapture(options.trsOutPath, "TRS");
+  CHECK(findBytes(trs, {0xB0, 100}) >= 0);
+  CHECK(findBytes(trs, {100, 127}) >= 0);
+  for (uint8_t byte : trs) {
+    CHECK(byte < 0x80 || byte == 0xB0);
+  }
+  return true;
+}
+
+/*
+ * TRS MIDI
+ */
+
+// a value for a new control, when every entry is still waiting to go out,
+// mustn't push out a live control's value; retired ones make way for it
+static bool testTrsFullTable() {
+  SimOptions options;
+  options.trsOutPath = "trs_full_table.txt";
+  CHECK(simInit(options));
+
+  TrsMidiEncoder<4> trs;
+  trs.begin(halMicros());
+  for (uint8_t cc = 0; cc < 4; cc++) {
+    trs.setControlChange(0xB0, cc, 10, false);
+  }
+  trs.setControlChange(0xB0, 20, 99, false);
+  CHECK(trs.pending());
+  runTrs(trs, 20);
+  CHECK(!trs.pending());
+
+  // retired controls give way, whatever their channel
+  for (uint8_t cc = 0; cc < 4; cc++) {
+    trs.setControlChange(0xB1, cc, 11, false);
+  }
+  trs.retire();
+  trs.setControlChange(0xB0, 20, 100, false);
+  runTrs(trs, 20);
+  simShutdown();
+
+  std::vector<uint8_t> bytes = readCapture(options.trsOutPath, "TRS");
+  for (uint8_t cc = 0; cc < 4; cc++) {
+    CHECK(findBytes(bytes, {cc, 10}) >= 0);
+  }
+  CHECK(findBytes(bytes, {20, 99}) < 0); // no entry for it
+  CHECK(findBytes(bytes, {20, 100}) >= 0);
+  CHECK(findBytes(bytes, {0, 11}) < 0); // the oldest retired value gave way
+  CHECK(findBytes(bytes, {1, 11}) >= 0);
+  return true;
+}
+
+// a realtime byte queued behind a long sysex goes out in the middle of it
+static bool testTrsRealtimeInSysex() {
+  SimOptions options;
+  options.trsOutPath = "trs_realtime_in_sysex.txt";
+  CHECK(simInit(options));
+
+  std::vector<uint8_t> sysex(200, 0x10);
+  sysex.front() = 0xF0;
+  sysex.back()  = 0xF7;
+  uint8_t clock = 0xF8;
+
+  TrsMidiEncoder<4> trs;
+  trs.begin(halMicros());
+  trs.writeThru(sysex.data(), sysex.size());
+  runTrs(trs, 1);
+  trs.writeThru(&clock, 1);
+  runTrs(trs, 100);
+  simShutdown();
+
+  std::vector<uint8_t> bytes = readCapture(options.trsOutPath, "TRS");
+  int clockAt                = findBytes(bytes, {0xF8});
+  CHECK(clockAt > 0);
+  CHECK(clockAt < findBytes(bytes, {0xF7}));
+  CHECK(bytes.size() == sysex.size() + 1);
+  bytes.erase(bytes.begin() + clockAt);
+  CHECK(bytes == sysex);
+  return true;
+}
+
+// with MIDI thru on, a sysex longer than the parser's buffer still goes out
+// on TRS whole and unbroken (but for realtime bytes), and USB input waits
+// while it does; one with our header that's too long goes nowhere
+static bool testLongSysexThru() {
+  SimOptions options;
+  options.usbInPath  = "long_sysex_thru_in.txt";
+  options.trsOutPath = "long_sysex_thru_trs.txt";
+  std::vector<uint8_t> sysex(1000);
+  for (size_t i = 0; i < sysex.size(); i++) {
+    sysex[i] = i % 128;
+  }
+  sysex.front()             = 0xF0;
+  sysex[1]                  = 0x43;
+  sysex.back()              = 0xF7;
+  std::vector<uint8_t> note = {0x90, 0x3C, 0x64};
+
+  FILE *f = fopen(options.usbInPath, "w");
+  CHECK(f);
+  // all at once, a line (which the sim reads up to 1k of) at a time
+  for (size_t i = 0; i < sysex.size(); i++) {
+    fprintf(f, "%s %02X", i % 64 ? "" : "100", sysex[i]);
+    if (i == 500) {
+      fprintf(f, " F8"); // a clock in the middle
+    }
+    if (i % 64 == 63) {
+      fprintf(f, "\n");
+    }
+  }
+  fprintf(f, " %02X %02X %02X\n", note[0], note[1], note[2]);
+  fprintf(f, "200 F0 7D 00 00 0E");
+  for (int i = 0; i < 2 * SYSEX_BUFFER_SIZE; i++) {
+    fprintf(f, "%s 00", i % 64 == 63 ? "\n200" : "");
+  }
+  fprintf(f, " F7\n");
+  fclose(f);
+  CHECK(simInit(options));
+
+  uint8_t memoryMap[MEMORY_MAP_LENGTH];
+  memcpy(memoryMap, defaultMemoryMap, sizeof(memoryMap));
+  memoryMap[8] = 1; // MIDI thru
+  configStoreInit(0);
+  CHECK(configStoreSave(memoryMap, sizeof(memoryMap)));
+
+  faderbankSetup();
+  runFaderbank(1500);
+  simShutdown();
+
+  std::vector<uint8_t> bytes = readCapture(options.trsOutPath, "TRS");
+  int start                  = findBytes(bytes, {0xF0, 0x43});
+  CHECK(start >= 0);
+  CHECK(findBytes(bytes, {0xF0, 0x7D}) == -1);
+  std::vector<uint8_t> sent;
+  for (size_t i = start; i < bytes.size() && sent.size() < sysex.size() + note.size(); i++) {
+    if (bytes[i] < 0xF8) {
+      sent.push_back(bytes[i]);
+    }
+  }
+  std::vector<uint8_t> expected = sysex;
+  expected.insert(expected.end(), note.begin(), note.end());
+  CHECK(sent == expected);
+  CHECK(findBytes(bytes, {0xF8}) > start);
+  return true;
+}
+
+/*
+ * Scenes
+ */
+
+// an edit goes to the current scene only, and switching scenes (by sysex,
+// or a program change on the scene channel) switches the faders' outputs
+static bool testSceneSwitching() {
+  SimOptions options;
+  options.tracePath  = "scene_switching.csv";
+  options.usbInPath  = "scene_switching_in.txt";
+  options.usbOutPath = "scene_switching_out.txt";
+  CHECK(writeTrace(options.tracePath, {{0, 0}, {300, 0}, {600, 4095}, {800, 4095}, {1100, 0}, {1300, 0}, {1600, 4095}}));
+
+  uint8_t memoryMap[MEMORY_MAP_LENGTH];
+  memcpy(memoryMap, defaultMemoryMap, sizeof(memoryMap));
+  memoryMap[9] = 1; // scenes on channel 1
+  uint8_t scene = 1, usb[32];
+  for (int i = 0; i < 16; i++) {
+    usb[i]      = 2;
+    usb[16 + i] = 70 + i;
+  }
+
+  FILE *f = fopen(options.usbInPath, "w");
+  CHECK(f);
+  // scene 1 gets its own USB channels and CCs
+  writeSysex(f, 100, 0x05, &scene, 1);
+  writeSysex(f, 150, 0x0C, usb, sizeof(usb));
+  scene = 0;
+  writeSysex(f, 200, 0x05, &scene, 1);
+  fprintf(f, "700 C0 01\n");
+  writeSysex(f, 1200, 0x05, &scene, 1);
+  fclose(f);
+  CHECK(simInit(options));
+  configStoreInit(0);
+  CHECK(configStoreSave(memoryMap, sizeof(memoryMap)));
+
+  faderbankSetup();
+  runFaderbank(1600);
+  simShutdown();
+
+  // scene 0 is as it was
+  CHECK(configStoreImage()[48] == 32);
+  std::vector<CaptureLine> lines = readCaptureLines(options.usbOutPath, "USB");
+  CHECK(lastControlChange(lines, 0xB0, 32, 700000) == 127);
+  CHECK(lastControlChange(lines, 0xB1, 70, 700000) == -1);
+  CHECK(lastControlChange(lines, 0xB1, 70, 1200000) == 0);
+  CHECK(lastControlChange(lines, 0xB0, 32, 1200000) == 127);
+  CHECK(lastControlChange(lines, 0xB1, 70, 1600000) == 0);
+  CHECK(lastControlChange(lines, 0xB0, 32, 1600000) == 127);
+  bool backInScene0 = false;
+  for (const CaptureLine &line : lines) {
+    backInScene0 |= line.us > 1300000 && line.bytes.size() == 3 && line.bytes[0] == 0xB0 && line.bytes[1] == 32;
+  }
+  CHECK(backInScene0);
+  return true;
+}
+
+struct Test {
+  const char *name;
+  bool (*run)();
+};
+
+static const Test tests[] = {
+    {"cc14_destination_range", testCc14DestinationRange},
+    {"config_store_torn_write", testConfigStoreTornWrite},
+    {"config_store_verify_failures", testConfigStoreVerifyFailures},
+    {"debounced_commit", testDebouncedCommit},
+    {"high_res_memory_map", testHighResMemoryMap},
+    {"legacy_endpoints", testLegacyEndpoints},
+    {"long_sysex_thru", testLongSysexThru},
+    {"partial_edits", testPartialEdits},
+    {"scene_switching", testSceneSwitching},
+    {"trs_full_table", testTrsFullTable},
+    {"trs_realtime_in_sysex", testTrsRealtimeInSysex},
+};
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: 16next_sim_tests NAME\n");
+    return 1;
+  }
+  for (const Test &test : tests) {
+    if (!strcmp(argv[1], test.name)) {
+      return test.run() ? 0 : 1;
+    }
+  }
+  fprintf(stderr, "no test called %s\n", argv[1]);
+  return 1;
+}
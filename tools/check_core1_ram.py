@@ -0,0 +1,229 @@
+#!/usr/bin/env python3
+"""
+Checks that core1's scan path never touches flash.
+
+With CORE1_SCANNING, core1 keeps scanning while core0 erases and programs
+flash, when nothing can be read from it. So everything core1 runs once the
+scan has started - core1Loop() and the scan alarm's interrupt handler, and
+everything they call - has to be in RAM. HAL_RAM_FUNC (lib/hal.h) puts our
+own functions there, but a helper the compiler didn't inline, or a libgcc /
+__aeabi routine, can still end up in flash, and the firmware would only
+fail when a flash write happened to land mid-scan.
+
+This disassembles the firmware and walks the call graph from those roots,
+and fails if any function it reaches:
+
+- branches to an address in flash (XIP, 0x10000000-0x13ffffff)
+- calls through a register (which can't be checked), other than the SDK's
+  memcpy/memset wrappers, which jump into the boot ROM
+- has a literal that is an address in flash (a vtable, a const table, a
+  pointer to a function in flash)
+
+Builds without CORE1_SCANNING (no core1Loop), or with CORE1_FLASH_LOCKOUT
+(core1 is paused for flash writes), are skipped.
+
+    check_core1_ram.py [--objdump OBJDUMP] firmware.elf
+    check_core1_ram.py --self-test
+"""
+
+import argparse
+import re
+import subprocess
+import sys
+
+ROOTS = ("core1Loop", "faderScanAlarm")
+LOCKOUT_SYMBOL = "multicore_lockout_victim_init"
+FLASH_START = 0x10000000
+FLASH_END = 0x14000000
+
+# they call the boot ROM's routines through its function table; the ROM is
+# always readable
+INDIRECT_ALLOWED = {
+    "__wrap_memcpy",
+    "__wrap_memset",
+    "__aeabi_memcpy",
+    "__aeabi_memcpy4",
+    "__aeabi_memcpy8",
+    "__aeabi_memset",
+    "__aeabi_memset4",
+    "__aeabi_memset8",
+}
+
+FUNCTION_RE = re.compile(r"^([0-9a-f]+) <([^>]+)>:$")
+LINE_RE = re.compile(r"^\s*([0-9a-f]+):\s+([0-9a-f]{4}(?: [0-9a-f]{4})?|[0-9a-f]{8})\s+(\S+)\s*(.*)$")
+BRANCH_RE = re.compile(r"^b(?:lx|l|x)?(?:eq|ne|cs|hs|cc|lo|mi|pl|vs|vc|hi|ls|ge|lt|gt|le|al)?(?:\.[nw])?$")
+
+
+def in_flash(address):
+    return FLASH_START <= address < FLASH_END
+
+
+class Function:
+    def __init__(self, name, start):
+        self.name = name
+        self.start = start
+        self.end = start
+        self.lines = []  # (address, mnemonic, operands)
+
+
+def parse(disassembly):
+    """Functions by name, in address order, from objdump -d output."""
+    functions = []
+    current = None
+    for line in disassembly.splitlines():
+        match = FUNCTION_RE.match(line)
+        if match:
+            current = Function(match.group(2), int(match.group(1), 16))
+            functions.append(current)
+            continue
+        match = LINE_RE.match(line)
+        if match and current:
+            address = int(match.group(1), 16)
+            current.lines.append((address, match.group(3), match.group(4)))
+            current.end = address + 1
+    return functions
+
+
+def containing(functions, address):
+    for function in functions:
+        if function.start <= address < function.end or function.start == address:
+            return function
+    return None
+
+
+def check(disassembly):
+    """Returns (skipped reason or None, list of problems)."""
+    functions = parse(disassembly)
+    names = {function.name: function for function in functions}
+    if not any(root in names for root in ROOTS[:1]):
+        return "no core1Loop (CORE1_SCANNING is off)", []
+    if LOCKOUT_SYMBOL in names:
+        return "core1 is locked out during flash writes (CORE1_FLASH_LOCKOUT)", []
+
+    problems = []
+    seen = set()
+    queue = [(root, None) for root in ROOTS if root in names]
+    while queue:
+        name, caller = queue.pop()
+        if name in seen:
+            continue
+        seen.add(name)
+        function = names[name]
+        where = name if caller is None else "%s (from %s)" % (name, caller)
+        if in_flash(function.start):
+            problems.append("%s is in flash, at 0x%08x" % (where, function.start))
+            continue
+
+        for address, mnemonic, operands in function.lines:
+            if mnemonic == ".word":
+                value = int(operands.split()[0], 16)
+                if in_flash(value):
+                    problems.append("%s has a flash address, 0x%08x, at 0x%08x" % (where, value, address))
+                continue
+            if not BRANCH_RE.match(mnemonic):
+                continue
+            target = operands.split()[0] if operands else ""
+            if re.match(r"^(r\d+|ip|sl|fp|sb)$", target):
+                if name not in INDIRECT_ALLOWED:
+                    problems.append("%s calls through %s at 0x%08x" % (where, target, address))
+                continue
+            if not re.match(r"^[0-9a-f]+$", target):
+                continue  # bx lr, and the like
+            target = int(target, 16)
+            if function.start <= target < function.end:
+                continue
+            if in_flash(target):
+                problems.append("%s branches into flash, to 0x%08x, at 0x%08x" % (where, target, address))
+                continue
+            callee = containing(functions, target)
+            if callee:
+                queue.append((callee.name, name))
+    return None, problems
+
+
+SELF_TEST = """
+20000100 <core1Loop>:
+20000100:\tb510      \tpush\t{r4, lr}
+20000102:\tf000 f805 \tbl\t20000110 <helper>
+20000106:\td0fb      \tbeq.n\t20000100 <core1Loop>
+20000108:\tf000 f80a \tbl\t20000120 <__wrap_memcpy>
+2000010c:\te7f8      \tb.n\t20000100 <core1Loop>
+2000010e:\t46c0      \tnop
+
+20000110 <helper>:
+20000110:\t4801      \tldr\tr0, [pc, #4]
+20000112:\tf000 f8ed \tbl\t100002f0 <flashHelper>
+20000116:\t4770      \tbx\tlr
+20000118:\t10004000 \t.word\t0x10004000
+
+20000120 <__wrap_memcpy>:
+20000120:\t4b01      \tldr\tr3, [pc, #4]
+20000122:\t4718      \tbx\tr3
+
+20000130 <faderScanAlarm>:
+20000130:\t4798      \tblx\tr3
+20000132:\t4770      \tbx\tlr
+20000134:\t40054000 \t.word\t0x40054000
+
+100002f0 <flashHelper>:
+100002f0:\t4770      \tbx\tlr
+"""
+
+
+def self_test():
+    skipped, problems = check(SELF_TEST)
+    expected = [
+        "flash address, 0x10004000",
+        "branches into flash, to 0x100002f0",
+        "faderScanAlarm calls through r3",
+    ]
+    ok = skipped is None and len(problems) == len(expected)
+    for fragment in expected:
+        ok = ok and any(fragment in problem for problem in problems)
+    ok = ok and not any("__wrap_memcpy" in problem for problem in problems)
+
+    clean = SELF_TEST.split("20000130 <faderScanAlarm>")[0].replace("f000 f8ed \tbl\t100002f0 <flashHelper>", "46c0      \tnop")
+    clean = clean.replace("10004000 \t.word\t0x10004000", "20004000 \t.word\t0x20004000")
+    skipped, clean_problems = check(clean)
+    ok = ok and skipped is None and not clean_problems
+
+    skipped, _ = check(SELF_TEST.replace("core1Loop", "core0Loop"))
+    ok = ok and skipped is not None
+    skipped, _ = check(SELF_TEST + "\n20000200 <%s>:\n20000200:\t4770      \tbx\tlr\n" % LOCKOUT_SYMBOL)
+    ok = ok and skipped is not None
+
+    if not ok:
+        print("self-test FAILED:\n  " + "\n  ".join(problems + clean_problems), file=sys.stderr)
+        return 1
+    print("self-test ok")
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="check that core1's scan path runs from RAM")
+    parser.add_argument("elf", nargs="?")
+    parser.add_argument("--objdump", default="arm-none-eabi-objdump")
+    parser.add_argument("--self-test", action="store_true")
+    args = parser.parse_args()
+
+    if args.self_test:
+        return self_test()
+    if not args.elf:
+        parser.error("an ELF file is needed")
+
+    disassembly = subprocess.run([args.objdump, "-d", args.elf], check=True, capture_output=True, text=True).stdout
+    skipped, problems = check(disassembly)
+    if skipped:
+        print("check_core1_ram: %s: skipped, %s" % (args.elf, skipped))
+        return 0
+    if problems:
+        print("check_core1_ram: %s: core1 can reach flash:" % args.elf, file=sys.stderr)
+        for problem in problems:
+            print("  " + problem, file=sys.stderr)
+        return 1
+    print("check_core1_ram: %s: core1 runs from RAM" % args.elf)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())